@@ -0,0 +1,298 @@
+/*
+ * Copyright (c) 2024 Yahweasel
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/* Microbenchmarks of sdinter's own image handling, on synthetic images, with
+ * no model involved. Each benchmark reports its rate (megapixels per second,
+ * or runs per second for those that don't scale with the image) and the
+ * allocations it makes per run; results can be saved as a baseline, and a
+ * later run compared against one fails if anything got slower, or made more
+ * allocations, by more than the tolerance. The canny preprocessor is also
+ * checked against the library's own, and a mismatch fails the run.
+ *
+ *   sdbench [--sizes 512,1024,...] [--baseline FILE] [--save-baseline FILE]
+ *           [--tolerance FRACTION] [--threads N] [--json FILE]
+ */
+
+#define SDINTER_NO_MAIN
+#include "sdinter.cpp"
+
+// Allocation counting, by wrapping glibc's allocator
+extern "C" void* __libc_malloc(size_t size);
+extern "C" void* __libc_calloc(size_t count, size_t size);
+extern "C" void* __libc_realloc(void* ptr, size_t size);
+
+static std::atomic<uint64_t> alloc_count(0), alloc_bytes(0);
+
+extern "C" void* malloc(size_t size) {
+    alloc_count++;
+    alloc_bytes += size;
+    return __libc_malloc(size);
+}
+
+extern "C" void* calloc(size_t count, size_t size) {
+    alloc_count++;
+    alloc_bytes += count * size;
+    return __libc_calloc(count, size);
+}
+
+extern "C" void* realloc(void* ptr, size_t size) {
+    alloc_count++;
+    alloc_bytes += size;
+    return __libc_realloc(ptr, size);
+}
+
+// A smooth gradient with some noise, so it compresses like a real image
+static std::vector<uint8_t> synthetic_image(int width, int height) {
+    std::vector<uint8_t> image((size_t)width * height * 3);
+    uint32_t rng = 12345;
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            rng          = rng * 1664525 + 1013904223;
+            uint8_t* px  = &image[((size_t)y * width + x) * 3];
+            int noise    = (rng >> 28) - 8;
+            px[0]        = (uint8_t)std::min(std::max(x * 255 / width + noise, 0), 255);
+            px[1]        = (uint8_t)std::min(std::max(y * 255 / height + noise, 0), 255);
+            px[2]        = (uint8_t)std::min(std::max((x + y) * 127 / (width + height) * 2 + noise, 0), 255);
+        }
+    }
+    return image;
+}
+
+struct BenchResult {
+    std::string name;
+    int size;
+    double rate;
+    double seconds;  // median per run
+    double allocs;   // per run
+    double alloc_mb;
+};
+
+/* Run fn until at least min_time has passed (and at least three times),
+ * taking the median time. */
+static BenchResult measure(const std::string& name, int size, bool per_pixel, const std::function<void()>& fn) {
+    const double min_time = 0.5;
+    fn();  // warm up caches and pools
+    std::vector<double> times;
+    double total           = 0;
+    uint64_t count_before  = alloc_count;
+    uint64_t bytes_before  = alloc_bytes;
+    while (times.size() < 3 || total < min_time) {
+        auto start = std::chrono::steady_clock::now();
+        fn();
+        times.push_back(seconds_since(start));
+        total += times.back();
+    }
+    std::sort(times.begin(), times.end());
+
+    BenchResult result;
+    result.name         = name;
+    result.size         = size;
+    result.seconds      = times[times.size() / 2];
+    result.rate         = (per_pixel ? (double)size * size / 1e6 : 1.0) / result.seconds;
+    result.allocs       = (double)(alloc_count - count_before) / times.size();
+    result.alloc_mb     = (double)(alloc_bytes - bytes_before) / times.size() / 1048576.0;
+    printf("%-24s %5d %10.2f%s %10.4f %10.1f %10.1f\n", name.c_str(), size, result.rate, per_pixel ? " MP/s" : " /s  ",
+           result.seconds, result.allocs, result.alloc_mb);
+    fflush(stdout);
+    return result;
+}
+
+static int check_failures = 0;
+
+/* The library's preprocess_canny is what sdinter's canny replaces, so the
+ * edges it just made should match it; allow for a few pixels either side of a
+ * threshold, since the convolutions' rounding can differ. */
+static void check_canny(const DecodedImage& decoded, const uint8_t* edges) {
+    const std::vector<float>& args = control_preprocessors[0].args;
+    size_t size                    = (size_t)decoded.width * decoded.height * 3;
+    uint8_t* copy                  = (uint8_t*)malloc(size);
+    memcpy(copy, decoded.data.data(), size);
+    uint8_t* expected = preprocess_canny(copy, decoded.width, decoded.height, args[0], args[1], args[2], args[3],
+                                         args[4] != 0.0f);
+    size_t differ     = 0;
+    for (size_t i = 0; i < size; i += 3)
+        differ += edges[i] != expected[i];
+    free(expected);
+    double fraction = (double)differ / (size / 3);
+    if (fraction > 0.001) {
+        printf("MISMATCH canny@%d: %.3f%% of pixels differ from preprocess_canny\n", decoded.width, fraction * 100.0);
+        check_failures++;
+    }
+}
+
+static std::vector<BenchResult> run_benchmarks(const std::vector<int>& sizes, int n_threads) {
+    std::vector<BenchResult> results;
+    printf("%-24s %5s %15s %10s %10s %10s\n", "benchmark", "size", "rate", "s/run", "allocs", "alloc MB");
+
+    SDParams params;
+    params.prompt = "a photograph of an astronaut riding a horse on the moon, highly detailed";
+    results.push_back(measure("image_params", 0, false, [&] {
+        get_image_params(params, 42);
+    }));
+
+    for (int size : sizes) {
+        std::vector<uint8_t> image = synthetic_image(size, size);
+        sd_image_t sd_image        = {(uint32_t)size, (uint32_t)size, 3, image.data()};
+
+        int png_len      = 0;
+        uint8_t* png_mem = stbi_write_png_to_mem(image.data(), 0, size, size, 3, &png_len);
+
+        results.push_back(measure("decode_png", size, true, [&] {
+            int w, h, c;
+            stbi_image_free(stbi_load_from_memory(png_mem, png_len, &w, &h, &c, 3));
+        }));
+
+        for (int filter = 0; filter < N_RESIZE_FILTERS; filter++) {
+            // Down to a typical generation size, as for an init image
+            std::vector<uint8_t> out(512 * 512 * 3);
+            results.push_back(measure(std::string("resize_") + resize_filter_str[filter], size, true, [&] {
+                resize_image(image.data(), size, size, out.data(), 512, 512, 3,
+                             (ResizeFilter)filter, FIT_STRETCH, true, n_threads);
+            }));
+        }
+
+        DecodedImage decoded;
+        decoded.width   = size;
+        decoded.height  = size;
+        decoded.channel = decoded.src_channels = 3;
+        decoded.data    = buffer_pool.get(image.size());
+        memcpy(decoded.data.data(), image.data(), image.size());
+        std::vector<uint8_t> edges(image.size());
+        results.push_back(measure("canny", size, true, [&] {
+            canny_preprocessor(decoded, control_preprocessors[0].args, edges.data(), n_threads);
+        }));
+        check_canny(decoded, edges.data());
+
+        // Made afresh each time, since opaque_mask() only makes one per size
+        results.push_back(measure("opaque_mask_fill", size, true, [&] {
+            make_opaque_mask(size, size);
+        }));
+
+        results.push_back(measure("encode_png_stb", size, true, [&] {
+            int len;
+            free(stbi_write_png_to_mem(image.data(), 0, size, size, 3, &len));
+        }));
+
+        FILE* null = fopen("/dev/null", "wb");
+        for (auto name : {"png:1", "png:6", "png-mt:6", "qoi"}) {
+            ImageFormat format = parse_image_format(name);
+            results.push_back(measure(std::string("encode_") + name, size, true, [&] {
+                if (format.type == FORMAT_QOI)
+                    write_qoi(null, sd_image);
+                else
+                    write_png_zlib(null, sd_image, format, "");
+            }));
+        }
+        fclose(null);
+        free(png_mem);
+    }
+    return results;
+}
+
+static std::string result_key(const BenchResult& result) {
+    return result.name + "@" + std::to_string(result.size);
+}
+
+int main(int argc, const char* argv[]) {
+    std::vector<int> sizes = {512, 1024, 2048, 4096, 8192};
+    std::string baseline_path, save_path, json_path;
+    double tolerance = 0.1;
+    int n_threads    = get_num_physical_cores();
+
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (i + 1 >= argc) {
+            fprintf(stderr, "error: %s needs a value\n", arg.c_str());
+            return 1;
+        }
+        if (arg == "--sizes") {
+            sizes.clear();
+            std::stringstream list(argv[++i]);
+            std::string size;
+            while (std::getline(list, size, ','))
+                sizes.push_back(std::stoi(size));
+        } else if (arg == "--baseline") {
+            baseline_path = argv[++i];
+        } else if (arg == "--save-baseline") {
+            save_path = argv[++i];
+        } else if (arg == "--tolerance") {
+            tolerance = std::stod(argv[++i]);
+        } else if (arg == "--threads") {
+            n_threads = std::stoi(argv[++i]);
+        } else if (arg == "--json") {
+            json_path = argv[++i];
+        } else {
+            fprintf(stderr, "error: unknown argument: %s\n", arg.c_str());
+            return 1;
+        }
+    }
+
+    std::vector<BenchResult> results = run_benchmarks(sizes, n_threads);
+
+    nlohmann::json report = nlohmann::json::object();
+    for (auto& result : results) {
+        report[result_key(result)] = {{"rate", result.rate},
+                                      {"seconds", result.seconds},
+                                      {"allocs", result.allocs},
+                                      {"alloc_mb", result.alloc_mb}};
+    }
+    if (json_path != "") {
+        std::ofstream out(json_path);
+        out << report.dump(2) << std::endl;
+    }
+    if (save_path != "") {
+        std::ofstream out(save_path);
+        out << report.dump(2) << std::endl;
+        printf("saved baseline to %s\n", save_path.c_str());
+    }
+
+    int regressions = 0;
+    if (baseline_path != "") {
+        std::ifstream in(baseline_path);
+        if (!in) {
+            fprintf(stderr, "error: failed to open baseline %s\n", baseline_path.c_str());
+            return 1;
+        }
+        nlohmann::json baseline = nlohmann::json::parse(in);
+        for (auto& result : results) {
+            std::string key = result_key(result);
+            if (!baseline.contains(key))
+                continue;
+            double before = baseline[key]["rate"].get<double>();
+            double ratio  = result.rate / before;
+            if (ratio < 1.0 - tolerance) {
+                printf("REGRESSION %-30s %10.2f, baseline %10.2f (%+.0f%%)\n",
+                       key.c_str(), result.rate, before, (ratio - 1.0) * 100.0);
+                regressions++;
+            }
+            // At least one more allocation per run, so rounding doesn't count
+            double allocs_before = baseline[key]["allocs"].get<double>();
+            if (result.allocs > allocs_before * (1.0 + tolerance) && result.allocs >= allocs_before + 1.0) {
+                printf("REGRESSION %-30s %10.1f allocs/run, baseline %10.1f\n",
+                       key.c_str(), result.allocs, allocs_before);
+                regressions++;
+            }
+        }
+        printf("%d regression%s against %s\n", regressions, regressions == 1 ? "" : "s", baseline_path.c_str());
+    }
+    return regressions || check_failures ? 1 : 0;
+}
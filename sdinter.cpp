@@ -21,18 +21,49 @@
  * SOFTWARE.
  */
 
+#include <limits.h>
+#include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <fstream>
+#include <functional>
 #include <iostream>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <random>
+#include <set>
 #include <string>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 #include <iostream>
 #include <sstream>
 #include <exception>
+#include <stdexcept>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <zlib.h>
 
 #include "json.hpp"
 
@@ -48,10 +79,6 @@
 #define STB_IMAGE_WRITE_STATIC
 #include "stb_image_write.h"
 
-#define STB_IMAGE_RESIZE_IMPLEMENTATION
-#define STB_IMAGE_RESIZE_STATIC
-#include "stb_image_resize.h"
-
 const char* rng_type_to_str[] = {
     "std_default",
     "cuda",
@@ -88,6 +115,36 @@ const char* modes_str[] = {
     "convert",
 };
 
+// Filters for resizing input images
+enum ResizeFilter {
+    RESIZE_BOX,
+    RESIZE_TRIANGLE,
+    RESIZE_CATMULL_ROM,
+    RESIZE_LANCZOS,
+    N_RESIZE_FILTERS
+};
+
+const char* resize_filter_str[] = {
+    "box",
+    "triangle",
+    "catmull-rom",
+    "lanczos",
+};
+
+// How an input image whose aspect ratio differs from the output is fitted
+enum ResizeFit {
+    FIT_STRETCH,
+    FIT_CROP,
+    FIT_PAD,
+    N_RESIZE_FITS
+};
+
+const char* resize_fit_str[] = {
+    "stretch",
+    "crop",
+    "pad",
+};
+
 enum SDMode {
     TXT2IMG,
     IMG2IMG,
@@ -114,6 +171,7 @@ struct SDParams {
     sd_type_t wtype = SD_TYPE_COUNT;
     std::string lora_model_dir;
     std::string output_path = "output.png";
+    std::string output_format = "png";
     std::string input_path;
     std::string mask_path;
     std::string control_image_path;
@@ -151,6 +209,22 @@ struct SDParams {
     bool canny_preprocess         = false;
     bool color                    = false;
     int upscale_repeats           = 1;
+    int upscale_tile              = 512;  // input pixels per tile side, 0 for the whole image
+    int upscale_workers           = 1;
+    int upscale_threads           = 0;  // split among the upscale workers, 0 for n_threads
+    int prep_threads              = 0;  // decoding, resizing and preprocessing input images, 0 for n_threads
+    int encode_threads            = 0;  // compressing one png-mt image, 0 for every CPU
+    int upscale_memory            = 0;  // MB the upscale workers may use at once, 0 for no limit
+    int model_cache_size          = 0;  // MB of loaded models to keep; the one in use is always kept
+    std::string convert_cache;          // directory of weights already converted to wtype
+    std::string weights_shm;            // name of a shared memory store of weights
+    bool numa_workers             = false;
+    int image_cache_size          = 256;  // MB of decoded input images to keep
+    ResizeFilter resize_filter    = RESIZE_BOX;
+    ResizeFit resize_fit          = FIT_STRETCH;
+    int writer_threads            = 2;
+    int writer_queue              = 8;
+    int job_reorder               = 8;  // times a queued job may be passed over
 
     std::vector<int> skip_layers = {7, 8, 9};
     float slg_scale              = 0.;
@@ -178,6 +252,7 @@ void print_params(SDParams params) {
     printf("    style ratio:       %.2f\n", params.style_ratio);
     printf("    normalize input image :  %s\n", params.normalize_input ? "true" : "false");
     printf("    output_path:       %s\n", params.output_path.c_str());
+    printf("    output_format:     %s\n", params.output_format.c_str());
     printf("    init_img:          %s\n", params.input_path.c_str());
     printf("    mask_img:          %s\n", params.mask_path.c_str());
     printf("    control_image:     %s\n", params.control_image_path.c_str());
@@ -204,6 +279,22 @@ void print_params(SDParams params) {
     printf("    batch_count:       %d\n", params.batch_count);
     printf("    vae_tiling:        %s\n", params.vae_tiling ? "true" : "false");
     printf("    upscale_repeats:   %d\n", params.upscale_repeats);
+    printf("    upscale_tile:      %d\n", params.upscale_tile);
+    printf("    upscale_workers:   %d\n", params.upscale_workers);
+    printf("    upscale_threads:   %d\n", params.upscale_threads);
+    printf("    prep_threads:      %d\n", params.prep_threads);
+    printf("    encode_threads:    %d\n", params.encode_threads);
+    printf("    upscale_memory:    %dMB\n", params.upscale_memory);
+    printf("    model_cache_size:  %dMB\n", params.model_cache_size);
+    printf("    convert_cache:     %s\n", params.convert_cache.c_str());
+    printf("    weights_shm:       %s\n", params.weights_shm.c_str());
+    printf("    image_cache_size:  %dMB\n", params.image_cache_size);
+    printf("    resize_filter:     %s\n", resize_filter_str[params.resize_filter]);
+    printf("    resize_fit:        %s\n", resize_fit_str[params.resize_fit]);
+    printf("    numa_workers:      %s\n", params.numa_workers ? "true" : "false");
+    printf("    writer_threads:    %d\n", params.writer_threads);
+    printf("    writer_queue:      %d\n", params.writer_queue);
+    printf("    job_reorder:       %d\n", params.job_reorder);
 }
 
 void print_usage(int argc, const char* argv[]) {
@@ -212,8 +303,20 @@ void print_usage(int argc, const char* argv[]) {
     printf("arguments:\n");
     printf("  -h, --help                         show this help message and exit\n");
     printf("  -M, --mode [MODEL]                 run mode (txt2img or img2img or convert, default: txt2img)\n");
+    printf("                                     convert writes the model (with --vae merged in) as GGUF of --type to -o,\n");
+    printf("                                     or if -o isn't a .gguf, to MODEL.TYPE.gguf (MODEL.converted.gguf without\n");
+    printf("                                     --type) beside it; it never overwrites the model\n");
     printf("  -t, --threads N                    number of threads to use during computation (default: -1)\n");
-    printf("                                     If threads <= 0, then threads will be set to the number of CPU physical cores\n");
+    printf("                                     If threads <= 0, then threads will be set to the count recorded by\n");
+    printf("                                     --tune-threads for the model and type, or else the number of physical cores\n");
+    printf("                                     this process may use. The text encoder, diffusion model and VAE share it.\n");
+    printf("  --cpuset LIST                      only run on these CPUs (e.g. 0-15,32-47)\n");
+    printf("  --cpu-affinity {none, compact, spread}\n");
+    printf("                                     pin compute threads one per physical core, packed together or spread\n");
+    printf("                                     across the machine, via OpenMP (default: none)\n");
+    printf("  --tune-threads                     time a few sampling steps at several thread counts for the model and type,\n");
+    printf("                                     at the current size, and record the fastest for later runs without -t\n");
+    printf("  --tune-file FILE                   where thread counts are recorded (default: ~/.cache/sdinter-threads.json)\n");
     printf("  -m, --model [MODEL]                path to full model\n");
     printf("  --diffusion-model                  path to the standalone diffusion model\n");
     printf("  --clip_l                           path to the clip-l text encoder\n");
@@ -228,12 +331,41 @@ void print_usage(int argc, const char* argv[]) {
     printf("  --normalize-input                  normalize PHOTOMAKER input id images\n");
     printf("  --upscale-model [ESRGAN_PATH]      path to esrgan model. Upscale images after generate, just RealESRGAN_x4plus_anime_6B supported by now\n");
     printf("  --upscale-repeats                  Run the ESRGAN upscaler this many times (default 1)\n");
+    printf("  --upscale-tile N                   upscale in overlapping tiles of N pixels, each through every repeat\n");
+    printf("                                     (default: 512, 0 for the whole image at once)\n");
+    printf("  --upscale-workers N                upscale this many tiles at once, splitting the threads between them (default: 1)\n");
+    printf("  --upscale-threads N                threads for upscaling, split among the workers (default: 0, as -t)\n");
+    printf("  --prep-threads N                   threads for decoding, resizing and preprocessing input images (default: 0, as -t)\n");
+    printf("  --upscale-memory MB                run fewer upscale workers if their tiles would need more than this (default: no limit)\n");
     printf("  --type [TYPE]                      weight type (examples: f32, f16, q4_0, q4_1, q5_0, q5_1, q8_0, q2_K, q3_K, q4_K)\n");
     printf("                                     If not specified, the default is the type of the weight file\n");
     printf("  --lora-model-dir [DIR]             lora model directory\n");
+    printf("  --model-cache-size MB              keep loaded models warm up to this much RAM, evicting the least recently used (default: 0)\n");
+    printf("                                     0 keeps only the model in use\n");
+    printf("  --convert-cache DIR                with --type, convert each model to GGUF of that type in DIR the first time it's\n");
+    printf("                                     loaded, and load the converted file after that\n");
+    printf("  --weights-shm NAME                 keep weight files (converted to --type, if given) in /dev/shm/sdinter-NAME,\n");
+    printf("                                     or in NAME if it's a path, so restarts load them from RAM; checked against a\n");
+    printf("                                     checksum and the stable-diffusion.cpp revision before use. This saves no RAM:\n");
+    printf("                                     each copy stays in tmpfs, on top of the memory the loaded model takes, until\n");
+    printf("                                     deleted or reboot, and loads little faster than from the page cache or\n");
+    printf("                                     --convert-cache\n");
+    printf("  --image-cache-size MB              keep decoded and resized input, mask and control images up to this much RAM\n");
+    printf("                                     (default: 256)\n");
+    printf("  --resize-filter {box, triangle, catmull-rom, lanczos}\n");
+    printf("                                     filter for resizing the init image to the output size (default: box)\n");
+    printf("  --resize-fit {stretch, crop, pad}  fit an init image of another aspect ratio by stretching it, cropping its\n");
+    printf("                                     middle, or padding it with black (default: stretch)\n");
+    printf("  --writer-threads N                 number of threads encoding and writing images in the background (default: 2)\n");
+    printf("                                     0 writes each image before the next operation starts\n");
+    printf("  --writer-queue N                   number of images that may wait to be written (default: 8)\n");
+    printf("  --encode-threads N                 threads compressing each png-mt image (default: 0, every CPU)\n");
     printf("  -i, --init-img [IMAGE]             path to the input image, required by img2img\n");
     printf("  --control-image [IMAGE]            path to image condition, control net\n");
     printf("  -o, --output OUTPUT                path to write result image to (default: ./output.png)\n");
+    printf("  --output-format FORMAT             format to write results in (default: png)\n");
+    printf("                                     png, png:LEVEL (0-9, store, fast, best), png-mt[:LEVEL] (multithreaded),\n");
+    printf("                                     qoi, ppm or pam (parameters are written to a .json beside the image)\n");
     printf("  -p, --prompt [PROMPT]              the prompt to render\n");
     printf("  -n, --negative-prompt PROMPT       the negative prompt (default: \"\")\n");
     printf("  --cfg-scale SCALE                  unconditional guidance scale: (default: 7.0)\n");
@@ -269,6 +401,34 @@ void print_usage(int argc, const char* argv[]) {
     printf("  --canny                            apply canny preprocessor (edge detection)\n");
     printf("  --color                            Colors the logging tags according to level\n");
     printf("  -v, --verbose                      print extra info\n");
+    printf("  -I, --interactive                  read prompts and !commands from standard input\n");
+    printf("  --preview TARGET                   send each image, as soon as it's generated, to one long-running viewer:\n");
+    printf("                                     the path of a FIFO, or cmd:COMMAND to run a command fed binary PPM frames\n");
+    printf("                                     on its standard input (e.g. \"cmd:ffplay -f image2pipe -c:v ppm -\";\n");
+    printf("                                     also !preview)\n");
+    printf("  --events TARGET                    write a JSON line for each event (job queued/started/done, model load, step,\n");
+    printf("                                     decode, upscale, write, error, resources) to a file, FIFO, fd:N or unix:PATH;\n");
+    printf("                                     replaces the library's progress bar\n");
+    printf("  --jobs FILE                        run each line of a JSONL file (- for standard input) as a job,\n");
+    printf("                                     with keys named after these options (prompt, seed, width, init_img, output, ...)\n");
+    printf("                                     a job may have a \"priority\" (default: 0, higher runs first)\n");
+    printf("  --listen SOCKET                    serve jobs, in the same format, to any number of clients on a Unix socket;\n");
+    printf("                                     each client gets its own jobs' progress and results\n");
+    printf("  --job-reorder N                    let queued jobs run out of order, grouped by model and size, passing over\n");
+    printf("                                     any job at most N times (default: 8, 0 for arrival order); picks from the\n");
+    printf("                                     oldest 256 queued jobs\n");
+    printf("  --job-results FILE                 where to write one JSON result line per job (default: - for standard output,\n");
+    printf("                                     when everything else normally printed there goes to stderr)\n");
+    printf("  --numa-workers                     run jobs (interactive, --jobs or --listen) on one worker per NUMA node, each\n");
+    printf("                                     with its own models, pinned to the node's CPUs and memory; -t is then per\n");
+    printf("                                     worker, at most the node's physical cores\n");
+    printf("  --bench N                          benchmark: time N generations of each --bench-matrix combination, with a fixed\n");
+    printf("                                     seed, and report per-stage timings, images/sec and each combination's peak RSS\n");
+    printf("  --bench-warmup N                   untimed generations before each combination's (default: 1)\n");
+    printf("  --bench-matrix SPEC                settings to combine, as KEY=V1,V2;KEY=... with job keys (steps, batch_count,\n");
+    printf("                                     sampling_method, schedule, ...) and size=WxH (default: the current settings)\n");
+    printf("  --bench-results FILE               where to write the benchmark results as JSON (default: - for standard output,\n");
+    printf("                                     when everything else normally printed there goes to stderr)\n");
 }
 
 static std::string sd_basename(const std::string& path) {
@@ -344,6 +504,248 @@ std::string get_image_params(SDParams params, int64_t seed) {
     return pj.dump(2);
 }
 
+static double seconds_since(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+/* With --numa-workers, the NUMA worker running on this thread (-1 on any
+ * other), and the most threads it may give a context. */
+static thread_local int worker_id      = -1;
+static thread_local int worker_threads = 0;
+
+/* --events writes a JSON object per line for each thing that happens (jobs
+ * queued and started, model loads, sampling steps, decodes, upscales, writes,
+ * errors and resource usage), for programs driving sdinter to follow without
+ * scraping its text output. Lines are formatted on whichever thread has the
+ * event and queued in a fixed ring that never blocks; a thread of its own
+ * writes them out. If the reader falls far enough behind that the ring fills,
+ * events are dropped, and counted in a "dropped" event, rather than holding
+ * up generation. */
+class EventLog {
+public:
+    EventLog() : slots(new Slot[capacity]) {
+        for (size_t i = 0; i < capacity; i++)
+            slots[i].seq.store(i, std::memory_order_relaxed);
+    }
+
+    ~EventLog() {
+        close();
+    }
+
+    // Start writing to a file, a FIFO, fd:N or unix:PATH
+    void open(const std::string& target) {
+        close();
+        this->target = target;
+        stopping     = false;
+        signal(SIGPIPE, SIG_IGN);
+        thread = std::thread(&EventLog::run, this);
+        enabled.store(true, std::memory_order_release);
+    }
+
+    // Write out what's queued and stop
+    void close() {
+        enabled.store(false, std::memory_order_release);
+        if (!thread.joinable())
+            return;
+        stopping = true;
+        thread.join();
+    }
+
+    bool active() const {
+        return enabled.load(std::memory_order_acquire);
+    }
+
+    void emit(const char* type, nlohmann::json fields = nlohmann::json::object()) {
+        if (!active())
+            return;
+        if (!push(format(type, fields)))
+            dropped.fetch_add(1, std::memory_order_relaxed);
+    }
+
+private:
+    static const size_t capacity = 4096;
+
+    struct Slot {
+        std::atomic<size_t> seq;
+        std::string line;
+    };
+
+    static std::string format(const char* type, nlohmann::json& fields) {
+        fields["event"] = type;
+        fields["time"]  = std::chrono::duration<double>(std::chrono::system_clock::now().time_since_epoch()).count();
+        if (worker_id >= 0)
+            fields["worker"] = worker_id;
+        return fields.dump(-1, ' ', false, nlohmann::json::error_handler_t::replace) + "\n";
+    }
+
+    /* A bounded multi-producer queue: each slot's sequence number says whose
+     * turn it is, so producers only contend on claiming a position. */
+    bool push(std::string line) {
+        size_t pos = head.load(std::memory_order_relaxed);
+        Slot* slot;
+        while (true) {
+            slot       = &slots[pos % capacity];
+            size_t seq = slot->seq.load(std::memory_order_acquire);
+            if (seq == pos) {
+                if (head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    break;
+            } else if (seq < pos) {
+                return false;  // full
+            } else {
+                pos = head.load(std::memory_order_relaxed);
+            }
+        }
+        slot->line = std::move(line);
+        slot->seq.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Only the writer thread pops
+    bool pop(std::string& out) {
+        Slot& slot = slots[tail % capacity];
+        if (slot.seq.load(std::memory_order_acquire) != tail + 1)
+            return false;
+        out.append(slot.line);
+        slot.line.clear();
+        slot.seq.store(tail + capacity, std::memory_order_release);
+        tail++;
+        return true;
+    }
+
+    void run() {
+        std::string batch;
+        bool broken = false;
+        while (true) {
+            bool stop = stopping;
+            if (fd < 0 && !broken && !open_output()) {
+                // A FIFO without a reader yet keeps its events until one comes
+                if (errno != ENXIO) {
+                    fprintf(stderr, "events: failed to open %s: %s\n", target.c_str(), strerror(errno));
+                    broken = true;
+                }
+            }
+            batch.clear();
+            if (fd >= 0 || broken) {
+                while (batch.size() < 65536 && pop(batch))
+                    ;
+                uint64_t lost = dropped.exchange(0, std::memory_order_relaxed);
+                if (lost) {
+                    nlohmann::json fields = {{"count", lost}};
+                    batch += format("dropped", fields);
+                }
+            }
+            if (fd >= 0 && batch.size() && !write_all(batch)) {
+                fprintf(stderr, "events: writing to %s failed: %s\n", target.c_str(), strerror(errno));
+                close_output();
+                broken = true;
+            }
+            if (stop && (batch.size() == 0 || fd < 0))
+                break;
+            if (batch.size() == 0)
+                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+        close_output();
+    }
+
+    bool open_output() {
+        if (target.compare(0, 3, "fd:") == 0) {
+            fd       = atoi(target.c_str() + 3);
+            owned_fd = false;
+            return true;
+        }
+        owned_fd = true;
+        if (target.compare(0, 5, "unix:") == 0) {
+            struct sockaddr_un addr;
+            std::string path = target.substr(5);
+            if (path.size() >= sizeof(addr.sun_path)) {
+                errno = ENAMETOOLONG;
+                return false;
+            }
+            fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+            if (fd < 0)
+                return false;
+            memset(&addr, 0, sizeof(addr));
+            addr.sun_family = AF_UNIX;
+            strcpy(addr.sun_path, path.c_str());
+            if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+                ::close(fd);
+                fd = -1;
+                return false;
+            }
+            return true;
+        }
+        struct stat st;
+        if (stat(target.c_str(), &st) == 0 && S_ISFIFO(st.st_mode)) {
+            fd = ::open(target.c_str(), O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+            if (fd >= 0)
+                fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+            return fd >= 0;
+        }
+        fd = ::open(target.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        return fd >= 0;
+    }
+
+    bool write_all(const std::string& data) {
+        size_t off = 0;
+        while (off < data.size()) {
+            ssize_t ret = write(fd, data.data() + off, data.size() - off);
+            if (ret < 0 && errno == EINTR)
+                continue;
+            if (ret <= 0)
+                return false;
+            off += ret;
+        }
+        return true;
+    }
+
+    void close_output() {
+        if (fd >= 0 && owned_fd)
+            ::close(fd);
+        fd = -1;
+    }
+
+    std::unique_ptr<Slot[]> slots;
+    std::atomic<size_t> head{0};
+    size_t tail = 0;
+    std::atomic<uint64_t> dropped{0};
+    std::atomic<bool> enabled{false};
+    std::atomic<bool> stopping{false};
+    std::thread thread;
+    std::string target;
+    int fd        = -1;
+    bool owned_fd = false;
+};
+
+static EventLog event_log;
+
+/* The library has a single progress callback. With --events every step goes
+ * through here, and on to whoever else wants progress; with NUMA workers, to
+ * whoever wants it on the worker's thread, which is the one that samples. */
+static thread_local sd_progress_cb_t progress_cb = NULL;
+static thread_local void* progress_cb_data       = NULL;
+static bool progress_per_thread                  = false;
+
+static void events_progress_cb(int step, int steps, float time, void* data) {
+    event_log.emit("step", {{"step", step}, {"steps", steps}, {"seconds", time}});
+    if (progress_cb)
+        progress_cb(step, steps, time, progress_cb_data);
+}
+
+static void set_progress_callback(sd_progress_cb_t cb, void* data) {
+    progress_cb      = cb;
+    progress_cb_data = data;
+    if (progress_per_thread)
+        return;
+    if (event_log.active())
+        sd_set_progress_callback(events_progress_cb, NULL);
+    else
+        sd_set_progress_callback(cb, data);
+}
+
+// Set while --bench is collecting the library's logged stage timings
+static struct BenchTimings* bench_timings = NULL;
+static void note_stage_log(const char* log);
+
 /* Enables Printing the log level tag in color using ANSI escape codes */
 void sd_log_cb(enum sd_log_level_t level, const char* log, void* data) {
     SDParams* params = (SDParams*)data;
@@ -351,6 +753,14 @@ void sd_log_cb(enum sd_log_level_t level, const char* log, void* data) {
     const char* level_str;
     FILE* out_stream = (level == SD_LOG_ERROR) ? stderr : stdout;
 
+    if (log && (bench_timings || event_log.active()))
+        note_stage_log(log);
+    if (log && level == SD_LOG_ERROR && event_log.active()) {
+        std::string message = log;
+        while (message.size() && message.back() == '\n')
+            message.pop_back();
+        event_log.emit("error", {{"message", message}});
+    }
     if (!log || (!params->verbose && level <= SD_LOG_DEBUG)) {
         return;
     }
@@ -384,159 +794,3647 @@ void sd_log_cb(enum sd_log_level_t level, const char* log, void* data) {
         fprintf(out_stream, "[%-5s] ", level_str);
     }
     fputs(log, out_stream);
-    fflush(out_stream);
+    // Lines are already flushed on a terminal; elsewhere only warnings need to be prompt
+    if (level >= SD_LOG_WARN)
+        fflush(out_stream);
 }
 
-int perform_op(SDParams &params);
+/* How much a change to each parameter costs. Free parameters are passed to
+ * every operation. Cheap ones are settings of the context itself: the pinned
+ * stable-diffusion.cpp has no way to change them in place, so the context is
+ * rebuilt, but the same weights are read back (normally from the page cache).
+ * The old context is only kept if --model-cache-size has room for it, so by
+ * default switching back rebuilds again. Full ones change which weights are
+ * loaded, or onto which backend. */
+enum SDParamCost {
+    PARAM_FREE,
+    PARAM_CHEAP,
+    PARAM_FULL
+};
 
-int main(int argc, const char* argv[]) {
+#define SD_PARAMS_FIELDS(X)                   \
+    X(n_threads, PARAM_CHEAP)                 \
+    X(mode, PARAM_FREE)                       \
+    X(model_path, PARAM_FULL)                 \
+    X(clip_l_path, PARAM_FULL)                \
+    X(clip_g_path, PARAM_FULL)                \
+    X(t5xxl_path, PARAM_FULL)                 \
+    X(diffusion_model_path, PARAM_FULL)       \
+    X(vae_path, PARAM_FULL)                   \
+    X(taesd_path, PARAM_FULL)                 \
+    X(esrgan_path, PARAM_FREE)                \
+    X(controlnet_path, PARAM_FULL)            \
+    X(embeddings_path, PARAM_FULL)            \
+    X(stacked_id_embeddings_path, PARAM_FULL) \
+    X(input_id_images_path, PARAM_FREE)       \
+    X(wtype, PARAM_FULL)                      \
+    X(lora_model_dir, PARAM_FULL)             \
+    X(output_path, PARAM_FREE)                \
+    X(output_format, PARAM_FREE)              \
+    X(input_path, PARAM_FREE)                 \
+    X(mask_path, PARAM_FREE)                  \
+    X(control_image_path, PARAM_FREE)         \
+    X(prompt, PARAM_FREE)                     \
+    X(negative_prompt, PARAM_FREE)            \
+    X(min_cfg, PARAM_FREE)                    \
+    X(cfg_scale, PARAM_FREE)                  \
+    X(guidance, PARAM_FREE)                   \
+    X(style_ratio, PARAM_FREE)                \
+    X(clip_skip, PARAM_FREE)                  \
+    X(width, PARAM_FREE)                      \
+    X(height, PARAM_FREE)                     \
+    X(batch_count, PARAM_FREE)                \
+    X(video_frames, PARAM_FREE)               \
+    X(motion_bucket_id, PARAM_FREE)           \
+    X(fps, PARAM_FREE)                        \
+    X(augmentation_level, PARAM_FREE)         \
+    X(sample_method, PARAM_FREE)              \
+    X(schedule, PARAM_CHEAP)                  \
+    X(sample_steps, PARAM_FREE)               \
+    X(strength, PARAM_FREE)                   \
+    X(control_strength, PARAM_FREE)           \
+    X(rng_type, PARAM_CHEAP)                  \
+    X(seed, PARAM_FREE)                       \
+    X(verbose, PARAM_FREE)                    \
+    X(vae_tiling, PARAM_CHEAP)                \
+    X(control_net_cpu, PARAM_FULL)            \
+    X(normalize_input, PARAM_FREE)            \
+    X(clip_on_cpu, PARAM_FULL)                \
+    X(vae_on_cpu, PARAM_FULL)                 \
+    X(diffusion_flash_attn, PARAM_FULL)       \
+    X(canny_preprocess, PARAM_FREE)           \
+    X(color, PARAM_FREE)                      \
+    X(upscale_repeats, PARAM_FREE)            \
+    X(upscale_tile, PARAM_FREE)               \
+    X(upscale_workers, PARAM_FREE)            \
+    X(upscale_threads, PARAM_FREE)            \
+    X(prep_threads, PARAM_FREE)               \
+    X(encode_threads, PARAM_FREE)             \
+    X(upscale_memory, PARAM_FREE)             \
+    X(model_cache_size, PARAM_FREE)           \
+    X(convert_cache, PARAM_FREE)              \
+    X(weights_shm, PARAM_FREE)                \
+    X(image_cache_size, PARAM_FREE)           \
+    X(resize_filter, PARAM_FREE)              \
+    X(resize_fit, PARAM_FREE)                 \
+    X(numa_workers, PARAM_FREE)               \
+    X(writer_threads, PARAM_FREE)             \
+    X(writer_queue, PARAM_FREE)               \
+    X(job_reorder, PARAM_FREE)                \
+    X(skip_layers, PARAM_FREE)                \
+    X(slg_scale, PARAM_FREE)                  \
+    X(skip_layer_start, PARAM_FREE)           \
+    X(skip_layer_end, PARAM_FREE)
+
+struct SDParamChange {
+    const char* name;
+    SDParamCost cost;
+};
+
+// Every parameter that differs between two sets, with what the change costs
+std::vector<SDParamChange> diff_params(const SDParams& from, const SDParams& to) {
+    std::vector<SDParamChange> changes;
+#define X(field, cost)              \
+    if (!(from.field == to.field)) \
+        changes.push_back({#field, cost});
+    SD_PARAMS_FIELDS(X)
+#undef X
+    return changes;
+}
+
+static std::string read_line(const std::string& path) {
+    std::ifstream in(path);
+    std::string line;
+    std::getline(in, line);
+    return line;
+}
+
+// "0-3,8,10-11" as a list of numbers
+static std::vector<int> parse_cpu_list(const std::string& list) {
+    std::vector<int> cpus;
+    std::stringstream ss(list);
+    std::string range;
+    while (std::getline(ss, range, ',')) {
+        int first, last;
+        int n = sscanf(range.c_str(), "%d-%d", &first, &last);
+        if (n < 1)
+            continue;
+        if (n == 1)
+            last = first;
+        for (int cpu = first; cpu <= last; cpu++)
+            cpus.push_back(cpu);
+    }
+    return cpus;
+}
+
+// Physical cores among the CPUs this process may run on (after --cpuset)
+static int allowed_cores() {
+    cpu_set_t set;
+    if (sched_getaffinity(0, sizeof(set), &set) != 0)
+        return get_num_physical_cores();
+    std::set<std::string> cores;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (!CPU_ISSET(cpu, &set))
+            continue;
+        std::string siblings = read_line("/sys/devices/system/cpu/cpu" + std::to_string(cpu) + "/topology/thread_siblings_list");
+        if (siblings == "")
+            return get_num_physical_cores();
+        cores.insert(siblings);
+    }
+    return cores.size() > 0 ? cores.size() : get_num_physical_cores();
+}
+
+/* --tune-threads times sampling at several thread counts and records the
+ * fastest for the model and type in a JSON file; when -t isn't given,
+ * contexts use the recorded count if there is one, and otherwise one thread
+ * per allowed physical core. The size isn't part of the key, since the thread
+ * count is part of the context and a change of size shouldn't rebuild it. */
+static std::string thread_tuning_path;
+static nlohmann::json thread_tuning;
+static bool thread_tuning_loaded = false;
+static std::mutex thread_tuning_lock;
+
+static std::string thread_tuning_key(const SDParams& params) {
+    const std::string& model = params.model_path.size() ? params.model_path : params.diffusion_model_path;
+    char* real               = realpath(model.c_str(), NULL);
+    std::string key          = real ? real : model;
+    free(real);
+    key += params.wtype < SD_TYPE_COUNT ? std::string(":") + sd_type_name(params.wtype) : "";
+    return key;
+}
+
+static nlohmann::json load_thread_tuning() {
+    std::ifstream in(thread_tuning_path);
+    nlohmann::json tuning = in ? nlohmann::json::parse(in, nullptr, false) : nlohmann::json::object();
+    return tuning.is_object() ? tuning : nlohmann::json::object();
+}
+
+static int default_threads(const SDParams& params) {
+    if (thread_tuning_path != "") {
+        std::lock_guard<std::mutex> guard(thread_tuning_lock);
+        if (!thread_tuning_loaded) {
+            thread_tuning        = load_thread_tuning();
+            thread_tuning_loaded = true;
+        }
+        std::string key = thread_tuning_key(params);
+        // Ignoring anything unusable in a hand-edited file
+        if (thread_tuning.contains(key) && thread_tuning[key].is_object() && thread_tuning[key].contains("threads")) {
+            auto& threads = thread_tuning[key]["threads"];
+            if (threads.is_number_integer() && threads.get<int>() > 0)
+                return threads.get<int>();
+        }
+    }
+    static int cores = allowed_cores();
+    return cores;
+}
+
+// Threads for a stage with a setting of its own, which otherwise follows -t
+static int stage_threads(const SDParams& params, int threads) {
+    if (threads <= 0)
+        threads = params.n_threads > 0 ? params.n_threads : default_threads(params);
+    if (worker_threads > 0)
+        threads = std::min(threads, worker_threads);
+    return threads;
+}
+
+/* The parameters a context is actually built from. Settings which have no
+ * effect in this configuration are normalized away, so that changing them
+ * doesn't rebuild anything. */
+static SDParams sd_ctx_params(const SDParams& params) {
+    SDParams ctx_params;
+#define X(field, cost)     \
+    if (cost != PARAM_FREE) \
+        ctx_params.field = params.field;
+    SD_PARAMS_FIELDS(X)
+#undef X
+    if (ctx_params.n_threads <= 0)
+        ctx_params.n_threads = default_threads(params);
+    if (ctx_params.controlnet_path.size() == 0)
+        ctx_params.control_net_cpu = false;
+    return ctx_params;
+}
+
+/* Pool of loaded contexts, most recently used first. Switching between
+ * models (or back) only loads from disk when the configuration isn't already
+ * warm. */
+struct SDContextEntry {
     SDParams params;
+    sd_ctx_t* ctx;
+    bool vae_decode_only;
+    size_t size;
+    int worker;
+};
 
-    sd_set_log_callback(sd_log_cb, (void*)&params);
+/* NUMA workers share the pool, each using and evicting only its own entries,
+ * so the list is guarded; contexts are never loaded or freed with it held. */
+static std::list<SDContextEntry> sd_ctx_pool;
+static std::mutex sd_ctx_pool_lock;
 
-    int64_t seed = -1;
-    params.n_threads = get_num_physical_cores();
-    srand((int)time(NULL));
+// Estimate of the memory a context will hold: the size of its weight files
+static size_t sd_ctx_size(const SDParams& params) {
+    const std::string* paths[] = {
+        &params.model_path,
+        &params.clip_l_path,
+        &params.clip_g_path,
+        &params.t5xxl_path,
+        &params.diffusion_model_path,
+        &params.vae_path,
+        &params.taesd_path,
+        &params.controlnet_path,
+    };
+    size_t size = 0;
+    struct stat sbuf;
+    for (auto path : paths) {
+        if (path->size() > 0 && !stat(path->c_str(), &sbuf))
+            size += sbuf.st_size;
+    }
+    return size;
+}
 
-    bool invalid_arg = false, interactive = false;
-    std::string arg;
-    for (int i = 1; i < argc; i++) {
-        arg = argv[i];
+static size_t sd_ctx_pool_size() {
+    std::lock_guard<std::mutex> guard(sd_ctx_pool_lock);
+    size_t size = 0;
+    for (auto& entry : sd_ctx_pool)
+        size += entry.size;
+    return size;
+}
 
-        if (arg == "-t" || arg == "--threads") {
-            if (++i >= argc) {
-                invalid_arg = true;
-                break;
-            }
-            params.n_threads = std::stoi(argv[i]);
-        } else if (arg == "-M" || arg == "--mode") {
-            if (++i >= argc) {
-                invalid_arg = true;
-                break;
-            }
-            const char* mode_selected = argv[i];
-            int mode_found            = -1;
-            for (int d = 0; d < MODE_COUNT; d++) {
-                if (!strcmp(mode_selected, modes_str[d])) {
-                    mode_found = d;
-                }
-            }
-            if (mode_found == -1) {
-                fprintf(stderr,
-                        "error: invalid mode %s, must be one of [txt2img, img2img, img2vid, convert]\n",
-                        mode_selected);
-                exit(1);
-            }
-            params.mode = (SDMode)mode_found;
-        } else if (arg == "-m" || arg == "--model") {
-            if (++i >= argc) {
-                invalid_arg = true;
-                break;
-            }
-            params.model_path = argv[i];
-        } else if (arg == "--clip_l") {
-            if (++i >= argc) {
-                invalid_arg = true;
-                break;
-            }
-            params.clip_l_path = argv[i];
-        } else if (arg == "--clip_g") {
-            if (++i >= argc) {
-                invalid_arg = true;
-                break;
-            }
-            params.clip_g_path = argv[i];
-        } else if (arg == "--t5xxl") {
-            if (++i >= argc) {
-                invalid_arg = true;
-                break;
-            }
-            params.t5xxl_path = argv[i];
-        } else if (arg == "--diffusion-model") {
-            if (++i >= argc) {
-                invalid_arg = true;
+/* Evict this worker's least recently used contexts until another `extra`
+ * bytes fit the budget, which each worker has to itself */
+static void sd_ctx_pool_trim(const SDParams& params, size_t extra) {
+    size_t budget = (size_t)params.model_cache_size * 1024 * 1024;
+    std::vector<SDContextEntry> evicted;
+    {
+        std::lock_guard<std::mutex> guard(sd_ctx_pool_lock);
+        size_t size = 0;
+        for (auto& entry : sd_ctx_pool) {
+            if (entry.worker == worker_id)
+                size += entry.size;
+        }
+        auto it = sd_ctx_pool.end();
+        while (it != sd_ctx_pool.begin() && size + extra > budget) {
+            --it;
+            if (it->worker != worker_id)
+                continue;
+            size -= it->size;
+            evicted.push_back(*it);
+            it = sd_ctx_pool.erase(it);
+        }
+    }
+    for (auto& entry : evicted) {
+        if (params.verbose)
+            printf("evicting model context (%zuMB)\n", entry.size / 1024 / 1024);
+        free_sd_ctx(entry.ctx);
+    }
+}
+
+// A model file's name without its directory or extension
+static std::string model_stem(const std::string& path) {
+    std::string name = sd_basename(path);
+    size_t dot       = name.find_last_of('.');
+    return dot != std::string::npos && dot > 0 ? name.substr(0, dot) : name;
+}
+
+// Recorded with weights kept in shared memory; the Makefile passes the real one
+#ifndef SDCPP_REVISION
+#define SDCPP_REVISION "dcf91f9e0f2cbf9da472ee2a556751ed4bab2d2a"
+#endif
+
+/* Weights can be kept as copies that load faster than the originals.
+ * --convert-cache keeps them converted to --type on disk, so nothing is
+ * re-quantized while loading; --weights-shm keeps them (also converted, with
+ * a --type) in shared memory, which outlives the process, so a restart reads
+ * them from RAM rather than disk. Each copy is named for what it was made
+ * from: the source's path, size and modification time (and those of a VAE
+ * merged into it) and the type, so a changed source gets a new copy. Copies
+ * in shared memory also have a manifest with a checksum of their contents and
+ * the stable-diffusion.cpp revision, checked the first time a process uses
+ * them, and replace any earlier copies of the same source and type, which
+ * would otherwise hold their memory until reboot. Shared memory is tmpfs, so
+ * a copy there is pinned in RAM (or swap) as well as cached again as it's
+ * loaded: it saves no memory, and loads little faster than a file already in
+ * the page cache or a --convert-cache copy. */
+struct WeightStore {
+    std::string dir;
+    bool verify;
+};
+
+static std::string weights_shm_dir(const std::string& name) {
+    return name.find('/') != std::string::npos ? name : "/dev/shm/sdinter-" + name;
+}
+
+static uint64_t fnv1a(const std::string& str) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (unsigned char c : str) {
+        hash ^= c;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+// Copy a file (to if not NULL) while taking its crc32
+static bool checksum_file(const std::string& path, const std::string* to, uLong& crc) {
+    FILE* in = fopen(path.c_str(), "rb");
+    if (!in)
+        return false;
+    FILE* out = to ? fopen(to->c_str(), "wb") : NULL;
+    bool ok   = !to || out;
+    std::vector<uint8_t> buf(4 * 1024 * 1024);
+    crc = crc32(0, Z_NULL, 0);
+    size_t len;
+    while (ok && (len = fread(buf.data(), 1, buf.size(), in)) > 0) {
+        crc = crc32(crc, buf.data(), len);
+        if (out && fwrite(buf.data(), 1, len, out) != len)
+            ok = false;
+    }
+    if (ferror(in))
+        ok = false;
+    fclose(in);
+    if (out && fclose(out) != 0)
+        ok = false;
+    return ok;
+}
+
+// Copies already checked by this process, with their size and mtime then
+static std::map<std::string, std::string> verified_weights;
+static std::mutex verified_weights_lock;
+
+static std::string file_version(const struct stat& st) {
+    return std::to_string(st.st_size) + "@" + std::to_string(st.st_mtim.tv_sec) + "." + std::to_string(st.st_mtim.tv_nsec);
+}
+
+static void trust_weights(const std::string& stored) {
+    struct stat st;
+    if (stat(stored.c_str(), &st) != 0)
+        return;
+    std::lock_guard<std::mutex> guard(verified_weights_lock);
+    verified_weights[stored] = file_version(st);
+}
+
+/* Whether a stored copy matches its manifest. The whole copy is only read
+ * the first time; after that, it's trusted while its size and mtime are. */
+static bool verify_weights(const std::string& stored) {
+    struct stat st;
+    if (stat(stored.c_str(), &st) != 0)
+        return false;
+    {
+        std::lock_guard<std::mutex> guard(verified_weights_lock);
+        auto it = verified_weights.find(stored);
+        if (it != verified_weights.end() && it->second == file_version(st))
+            return true;
+    }
+    std::ifstream in(stored + ".json");
+    if (!in)
+        return false;
+    try {
+        nlohmann::json manifest = nlohmann::json::parse(in);
+        uLong crc;
+        if (manifest["sdcpp_revision"] != SDCPP_REVISION || manifest["size"].get<int64_t>() != (int64_t)st.st_size)
+            return false;
+        if (!checksum_file(stored, NULL, crc) || manifest["crc32"].get<uint64_t>() != crc)
+            return false;
+    } catch (const std::exception& e) {
+        return false;
+    }
+    trust_weights(stored);
+    return true;
+}
+
+/* Remove copies in the store made from source as type ("" for plain copies),
+ * other than keep. Copies of other types are left, since they may be in use. */
+static void prune_weights(const WeightStore& store, const std::string& path, const std::string& source,
+                          const std::string& type, const std::string& keep) {
+    DIR* dir = opendir(store.dir.c_str());
+    if (!dir)
+        return;
+    std::string prefix = model_stem(path) + "-";
+    while (struct dirent* ent = readdir(dir)) {
+        std::string name = ent->d_name;
+        if (name.compare(0, prefix.size(), prefix) != 0 || name.size() < 5 || name.compare(name.size() - 5, 5, ".json") != 0)
+            continue;
+        std::string copy = store.dir + "/" + name.substr(0, name.size() - 5);
+        if (copy == keep)
+            continue;
+        std::ifstream in(copy + ".json");
+        nlohmann::json manifest = nlohmann::json::parse(in, nullptr, false);
+        if (!manifest.is_object() || !manifest.contains("source") || !manifest["source"].is_string() ||
+            !manifest.contains("type") || manifest["type"] != type)
+            continue;
+        std::string other = manifest["source"].get<std::string>();
+        char* real        = realpath(other.c_str(), NULL);
+        if (real) {
+            other = real;
+            free(real);
+        }
+        if (other != source)
+            continue;
+        printf("removing %s, superseded by %s\n", copy.c_str(), keep.c_str());
+        unlink(copy.c_str());
+        unlink((copy + ".json").c_str());
+    }
+    closedir(dir);
+}
+
+/* The copy of path (with vae_path merged in, if converting) in this store,
+ * made if needed. Converts to type if there is one, otherwise copies as is.
+ * Returns path itself if it can't be made. */
+static std::string stored_weights(const WeightStore& store, const std::string& path, const std::string& vae_path, sd_type_t type) {
+    if (path == "")
+        return path;
+    bool converting = type < SD_TYPE_COUNT;
+
+    std::string key = converting ? sd_type_name(type) : "copy";
+    std::string source_real;
+    for (const std::string& source : {path, vae_path}) {
+        if (source == "")
+            continue;
+        struct stat st;
+        char* real = realpath(source.c_str(), NULL);
+        if (!real || stat(real, &st) != 0) {
+            free(real);
+            return path;
+        }
+        key += "\n" + std::string(real) + "\n" + std::to_string(st.st_size) + "\n" +
+               std::to_string(st.st_mtim.tv_sec) + "." + std::to_string(st.st_mtim.tv_nsec);
+        if (source_real == "")
+            source_real = real;
+        free(real);
+    }
+    std::string ext = ".gguf";
+    if (!converting) {
+        std::string name = sd_basename(path);
+        size_t dot       = name.find_last_of('.');
+        ext              = dot != std::string::npos && dot > 0 ? name.substr(dot) : "";
+    }
+    char name[64];
+    snprintf(name, sizeof(name), "-%s-%016llx", converting ? sd_type_name(type) : "copy", (unsigned long long)fnv1a(key));
+    std::string stored = store.dir + "/" + model_stem(path) + name + ext;
+
+    struct stat st;
+    if (stat(stored.c_str(), &st) == 0) {
+        if (!store.verify || verify_weights(stored))
+            return stored;
+        fprintf(stderr, "%s doesn't match its manifest, replacing it\n", stored.c_str());
+        unlink(stored.c_str());
+    }
+
+    if (mkdir(store.dir.c_str(), 0755) != 0 && errno != EEXIST) {
+        fprintf(stderr, "failed to create %s: %s\n", store.dir.c_str(), strerror(errno));
+        return path;
+    }
+    // Written under a temporary name, so a half-written copy is never used
+    std::string temp = stored + ".tmp" + std::to_string(getpid());
+    printf("%s %s into %s\n", converting ? "converting" : "copying", path.c_str(), store.dir.c_str());
+    auto start = std::chrono::steady_clock::now();
+    uLong crc  = 0;
+    bool ok;
+    if (converting)
+        ok = convert(path.c_str(), vae_path.c_str(), temp.c_str(), type) && (!store.verify || checksum_file(temp, NULL, crc));
+    else
+        ok = checksum_file(path, &temp, crc);
+    if (ok && store.verify) {
+        stat(temp.c_str(), &st);
+        nlohmann::json manifest = {{"source", source_real},
+                                   {"vae", vae_path},
+                                   {"type", converting ? sd_type_name(type) : ""},
+                                   {"size", (int64_t)st.st_size},
+                                   {"crc32", (uint64_t)crc},
+                                   {"sdcpp_revision", SDCPP_REVISION}};
+        std::ofstream out(stored + ".json");
+        out << manifest.dump(2) << std::endl;
+        ok = (bool)out;
+    }
+    if (ok && rename(temp.c_str(), stored.c_str()) != 0)
+        ok = false;
+    event_log.emit(converting ? "convert" : "copy_weights",
+                   {{"source", path}, {"output", stored}, {"ok", ok}, {"seconds", seconds_since(start)}});
+    if (!ok) {
+        unlink(temp.c_str());
+        fprintf(stderr, "storing %s in %s failed, loading it directly\n", path.c_str(), store.dir.c_str());
+        return path;
+    }
+    if (store.verify) {
+        trust_weights(stored);
+        prune_weights(store, path, source_real, converting ? sd_type_name(type) : "", stored);
+    }
+    return stored;
+}
+
+/* Point every weight file of a context at its copy in a store. Once all of
+ * them are converted, the context is built with no type, so nothing is
+ * converted again as it loads. */
+static void place_weights(const WeightStore& store, bool convert_only, SDParams& load_params) {
+    bool converting = load_params.wtype < SD_TYPE_COUNT;
+    if (convert_only && !converting)
+        return;
+    bool all = true;
+    auto use = [&](std::string& path, const std::string& vae_path) {
+        std::string stored = stored_weights(store, path, vae_path, load_params.wtype);
+        if (stored == path && path != "")
+            all = false;
+        path = stored;
+    };
+    // A full checkpoint has the VAE merged into its converted copy
+    if (load_params.model_path != "") {
+        use(load_params.model_path, converting ? load_params.vae_path : "");
+        if (converting && all)
+            load_params.vae_path = "";
+    }
+    use(load_params.diffusion_model_path, "");
+    use(load_params.clip_l_path, "");
+    use(load_params.clip_g_path, "");
+    use(load_params.t5xxl_path, "");
+    use(load_params.vae_path, "");
+    if (converting && all)
+        load_params.wtype = SD_TYPE_COUNT;
+}
+
+/* Get a context for these parameters, loading it if it isn't in the pool. A
+ * context with the VAE encoder loaded also serves decode-only requests. */
+static sd_ctx_t* acquire_sd_ctx(const SDParams& params, bool vae_decode_only) {
+    SDParams ctx_params = sd_ctx_params(params);
+    std::unique_lock<std::mutex> guard(sd_ctx_pool_lock);
+    for (auto it = sd_ctx_pool.begin(); it != sd_ctx_pool.end(); it++) {
+        if (it->worker != worker_id || diff_params(it->params, ctx_params).size() != 0)
+            continue;
+        if (it->vae_decode_only && !vae_decode_only) {
+            printf("reloading model: VAE encoder needed\n");
+            sd_ctx_t* stale = it->ctx;
+            sd_ctx_pool.erase(it);
+            guard.unlock();
+            free_sd_ctx(stale);
+            guard.lock();
+            break;
+        }
+        sd_ctx_pool.splice(sd_ctx_pool.begin(), sd_ctx_pool, it);
+        return it->ctx;
+    }
+
+    // Say why, relative to the context we were using
+    auto current = sd_ctx_pool.begin();
+    while (current != sd_ctx_pool.end() && current->worker != worker_id)
+        current++;
+    if (current != sd_ctx_pool.end()) {
+        auto changes       = diff_params(current->params, ctx_params);
+        SDParamCost cost   = PARAM_FREE;
+        std::string fields = "";
+        for (auto& change : changes) {
+            if (change.cost > cost)
+                cost = change.cost;
+            if (fields.size())
+                fields += ", ";
+            fields += change.name;
+        }
+        if (cost == PARAM_FULL)
+            printf("reloading model: %s changed\n", fields.c_str());
+        else if (cost == PARAM_CHEAP)
+            printf("rebuilding context: %s changed\n", fields.c_str());
+    }
+    guard.unlock();
+
+    size_t size = sd_ctx_size(ctx_params);
+    sd_ctx_pool_trim(params, size);
+
+    std::string model = ctx_params.model_path.size() ? ctx_params.model_path : ctx_params.diffusion_model_path;
+    event_log.emit("model_load_begin", {{"model", model}, {"vae_decode_only", vae_decode_only}});
+    auto start = std::chrono::steady_clock::now();
+
+    // The pool stays keyed by the source files, whichever copy is loaded
+    SDParams load_params = ctx_params;
+    if (params.convert_cache != "")
+        place_weights(WeightStore{params.convert_cache, false}, true, load_params);
+    if (params.weights_shm != "")
+        place_weights(WeightStore{weights_shm_dir(params.weights_shm), true}, false, load_params);
+    if (worker_threads > 0)
+        load_params.n_threads = std::min(load_params.n_threads, worker_threads);
+
+    sd_ctx_t* ctx = new_sd_ctx(load_params.model_path.c_str(),
+                               load_params.clip_l_path.c_str(),
+                               load_params.clip_g_path.c_str(),
+                               load_params.t5xxl_path.c_str(),
+                               load_params.diffusion_model_path.c_str(),
+                               load_params.vae_path.c_str(),
+                               ctx_params.taesd_path.c_str(),
+                               ctx_params.controlnet_path.c_str(),
+                               ctx_params.lora_model_dir.c_str(),
+                               ctx_params.embeddings_path.c_str(),
+                               ctx_params.stacked_id_embeddings_path.c_str(),
+                               vae_decode_only,
+                               ctx_params.vae_tiling,
+                               false,
+                               load_params.n_threads,
+                               load_params.wtype,
+                               ctx_params.rng_type,
+                               ctx_params.schedule,
+                               ctx_params.clip_on_cpu,
+                               ctx_params.control_net_cpu,
+                               ctx_params.vae_on_cpu,
+                               ctx_params.diffusion_flash_attn);
+    event_log.emit("model_load_end", {{"model", model}, {"ok", ctx != NULL}, {"seconds", seconds_since(start)}});
+    if (ctx == NULL)
+        return NULL;
+
+    guard.lock();
+    sd_ctx_pool.push_front(SDContextEntry{ctx_params, ctx, vae_decode_only, size, worker_id});
+    return ctx;
+}
+
+// Drop a context from the pool, e.g. after it failed to generate
+static void release_sd_ctx(sd_ctx_t* ctx) {
+    {
+        std::lock_guard<std::mutex> guard(sd_ctx_pool_lock);
+        for (auto it = sd_ctx_pool.begin(); it != sd_ctx_pool.end(); it++) {
+            if (it->ctx == ctx) {
+                sd_ctx_pool.erase(it);
                 break;
             }
-            params.diffusion_model_path = argv[i];
-        } else if (arg == "--vae") {
-            if (++i >= argc) {
+        }
+    }
+    free_sd_ctx(ctx);
+}
+
+// Only while no jobs are running
+static void unload_sd_ctx_pool() {
+    std::list<SDContextEntry> entries;
+    {
+        std::lock_guard<std::mutex> guard(sd_ctx_pool_lock);
+        entries.swap(sd_ctx_pool);
+    }
+    for (auto& entry : entries)
+        free_sd_ctx(entry.ctx);
+}
+
+static void print_sd_ctx_pool() {
+    std::lock_guard<std::mutex> guard(sd_ctx_pool_lock);
+    std::set<int> workers;
+    size_t total = 0;
+    int i        = 0;
+    for (auto& entry : sd_ctx_pool) {
+        const SDParams& params = entry.params;
+        // The one each worker used last is marked
+        bool current = workers.insert(entry.worker).second;
+        if (entry.worker >= 0)
+            printf("[worker %d] ", entry.worker);
+        printf("%s%d: %s%s%s, %d threads%s (%zuMB)\n",
+               current ? "* " : "  ",
+               i,
+               sd_basename(params.model_path.size() ? params.model_path : params.diffusion_model_path).c_str(),
+               params.vae_path.size() ? " + " : "",
+               sd_basename(params.vae_path).c_str(),
+               params.n_threads,
+               params.vae_tiling ? ", vae tiling" : "",
+               entry.size / 1024 / 1024);
+        total += entry.size;
+        i++;
+    }
+    printf("%zuMB in use\n", total / 1024 / 1024);
+}
+
+/* The upscalers are loaded on first use and kept until the model, thread
+ * count or number of workers changes, or they're explicitly unloaded. Each
+ * worker has its own context, since a context can only run one image at a
+ * time; ESRGAN models are small enough that this costs little. */
+struct UpscalerSet {
+    std::vector<upscaler_ctx_t*> ctxs;
+    std::string path;
+    int threads = 0;
+
+    void unload() {
+        for (auto ctx : ctxs)
+            free_upscaler_ctx(ctx);
+        ctxs.clear();
+    }
+};
+
+// One set per NUMA worker
+static std::map<int, UpscalerSet> upscalers;
+static std::mutex upscalers_lock;
+
+// Only while no jobs are running
+static void unload_upscaler_ctx() {
+    std::lock_guard<std::mutex> guard(upscalers_lock);
+    for (auto& set : upscalers)
+        set.second.unload();
+}
+
+// The upscaler contexts to use, or an empty list if the model fails to load
+static const std::vector<upscaler_ctx_t*>& acquire_upscaler_ctxs(const SDParams& params, int workers) {
+    UpscalerSet* set;
+    {
+        std::lock_guard<std::mutex> guard(upscalers_lock);
+        set = &upscalers[worker_id];
+    }
+    std::vector<upscaler_ctx_t*>& upscaler_ctxs = set->ctxs;
+
+    int n_threads = std::max(1, stage_threads(params, params.upscale_threads) / workers);
+    if (set->path != params.esrgan_path || set->threads != n_threads)
+        set->unload();
+    set->path    = params.esrgan_path;
+    set->threads = n_threads;
+
+    while ((int)upscaler_ctxs.size() > workers) {
+        free_upscaler_ctx(upscaler_ctxs.back());
+        upscaler_ctxs.pop_back();
+    }
+    while ((int)upscaler_ctxs.size() < workers) {
+        event_log.emit("model_load_begin", {{"model", params.esrgan_path}, {"upscaler", true}});
+        auto start          = std::chrono::steady_clock::now();
+        upscaler_ctx_t* ctx = new_upscaler_ctx(params.esrgan_path.c_str(), n_threads);
+        event_log.emit("model_load_end", {{"model", params.esrgan_path}, {"upscaler", true}, {"ok", ctx != NULL},
+                                          {"seconds", seconds_since(start)}});
+        if (ctx == NULL) {
+            set->unload();
+            break;
+        }
+        upscaler_ctxs.push_back(ctx);
+    }
+    return upscaler_ctxs;
+}
+
+/* Output encoders. "png" is stb's encoder at its default level, except for
+ * very large images, which stb would hold compressed in memory; "png:N" and
+ * "png-mt:N" are streaming zlib at level N (0 stores), the latter compressing
+ * stripes of rows on several threads; "qoi", "ppm" and "pam" are fast lossless
+ * formats with the parameters written to a .json sidecar. */
+enum ImageFormatType {
+    FORMAT_PNG_STB,
+    FORMAT_PNG,
+    FORMAT_QOI,
+    FORMAT_PPM,
+    FORMAT_PAM
+};
+
+struct ImageFormat {
+    ImageFormatType type = FORMAT_PNG_STB;
+    int level            = 6;
+    bool threaded        = false;
+    int threads          = 0;  // when threaded, 0 for every CPU
+};
+
+static ImageFormat parse_image_format(const std::string& str) {
+    ImageFormat format;
+    size_t colon     = str.find(':');
+    std::string name = str.substr(0, colon);
+    if (name == "png") {
+        format.type = colon == std::string::npos ? FORMAT_PNG_STB : FORMAT_PNG;
+    } else if (name == "png-mt") {
+        format.type     = FORMAT_PNG;
+        format.threaded = true;
+    } else if (name == "qoi") {
+        format.type = FORMAT_QOI;
+    } else if (name == "ppm") {
+        format.type = FORMAT_PPM;
+    } else if (name == "pam") {
+        format.type = FORMAT_PAM;
+    } else {
+        throw std::invalid_argument("invalid output format " + str);
+    }
+
+    if (colon != std::string::npos) {
+        std::string level = str.substr(colon + 1);
+        if (format.type != FORMAT_PNG)
+            throw std::invalid_argument("compression level is only supported for png");
+        if (level == "store")
+            format.level = 0;
+        else if (level == "fast")
+            format.level = 1;
+        else if (level == "best")
+            format.level = 9;
+        else
+            format.level = std::stoi(level);
+        if (format.level < 0 || format.level > 9)
+            throw std::invalid_argument("png compression level must be 0-9");
+    }
+    return format;
+}
+
+static const char* image_format_ext(const ImageFormat& format) {
+    switch (format.type) {
+        case FORMAT_QOI:
+            return ".qoi";
+        case FORMAT_PPM:
+            return ".ppm";
+        case FORMAT_PAM:
+            return ".pam";
+        default:
+            return ".png";
+    }
+}
+
+static void put_be32(uint8_t* out, uint32_t v) {
+    out[0] = v >> 24;
+    out[1] = v >> 16;
+    out[2] = v >> 8;
+    out[3] = v;
+}
+
+static void write_png_chunk(FILE* f, const char* type, const uint8_t* data, uint32_t len) {
+    uint8_t be[4];
+    put_be32(be, len);
+    fwrite(be, 1, 4, f);
+    fwrite(type, 1, 4, f);
+    if (len)
+        fwrite(data, 1, len, f);
+    uLong crc = crc32(0, (const Bytef*)type, 4);
+    if (len)
+        crc = crc32(crc, data, len);
+    put_be32(be, crc);
+    fwrite(be, 1, 4, f);
+}
+
+static uint8_t png_paeth(int a, int b, int c) {
+    int p  = a + b - c;
+    int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+    if (pa <= pb && pa <= pc)
+        return a;
+    return pb <= pc ? b : c;
+}
+
+// Filter one row: none when storing, Paeth otherwise
+static void png_filter_row(const uint8_t* row, const uint8_t* prev, int bytes, int bpp, int level, uint8_t* out) {
+    if (level == 0) {
+        out[0] = 0;
+        memcpy(out + 1, row, bytes);
+        return;
+    }
+    out[0] = 4;
+    for (int x = 0; x < bytes; x++) {
+        int a      = x >= bpp ? row[x - bpp] : 0;
+        int b      = prev ? prev[x] : 0;
+        int c      = prev && x >= bpp ? prev[x - bpp] : 0;
+        out[x + 1] = row[x] - png_paeth(a, b, c);
+    }
+}
+
+/* Deflate count rows as raw deflate data, ending on a byte boundary without
+ * a final block, so that stripes can simply be concatenated and their
+ * adler32s combined. prev is the row before the first, or NULL. */
+struct PNGStripe {
+    std::vector<uint8_t> data;
+    uLong adler;
+    size_t len;
+};
+
+static bool png_compress_stripe(const uint8_t* rows, const uint8_t* prev, int count, int bytes, int bpp, int level, PNGStripe& stripe) {
+    std::vector<uint8_t> row(bytes + 1);
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    if (deflateInit2(&zs, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        return false;
+
+    stripe.adler = adler32(0, NULL, 0);
+    stripe.len   = 0;
+    stripe.data.resize(deflateBound(&zs, (uLong)(bytes + 1) * count) + 16);
+    zs.next_out  = stripe.data.data();
+    zs.avail_out = stripe.data.size();
+
+    int ret = Z_OK;
+    for (int y = 0; y < count && ret == Z_OK; y++) {
+        const uint8_t* line = rows + (size_t)y * bytes;
+        png_filter_row(line, y ? line - bytes : prev, bytes, bpp, level, row.data());
+        stripe.adler = adler32(stripe.adler, row.data(), row.size());
+        stripe.len += row.size();
+        zs.next_in  = row.data();
+        zs.avail_in = row.size();
+        ret         = deflate(&zs, y + 1 < count ? Z_NO_FLUSH : Z_SYNC_FLUSH);
+    }
+    stripe.data.resize(zs.total_out);
+    deflateEnd(&zs);
+    return ret == Z_OK;
+}
+
+/* PNG encoder that takes the image a band of rows at a time, compressing and
+ * writing each band before the next arrives, so memory is bounded by the band
+ * rather than the image. Each band is split into stripes compressed on up to
+ * n_threads threads. */
+class PNGStreamWriter {
+public:
+    PNGStreamWriter(FILE* f, uint32_t width, uint32_t height, int channel, int level, int n_threads, const std::string& parameters)
+        : f(f), width(width), height(height), channel(channel), level(level), n_threads(std::max(n_threads, 1)) {
+        static const uint8_t color_types[] = {0, 0, 4, 2, 6};
+        static const uint8_t signature[]   = {137, 80, 78, 71, 13, 10, 26, 10};
+        uint8_t ihdr[13];
+        put_be32(ihdr, width);
+        put_be32(ihdr + 4, height);
+        ihdr[8]  = 8;
+        ihdr[9]  = color_types[channel];
+        ihdr[10] = ihdr[11] = ihdr[12] = 0;
+        fwrite(signature, 1, 8, f);
+        write_png_chunk(f, "IHDR", ihdr, 13);
+
+        if (parameters.size()) {
+            std::string text = std::string("parameters") + '\0' + parameters;
+            write_png_chunk(f, "tEXt", (const uint8_t*)text.data(), text.size());
+        }
+
+        static const uint8_t zlib_headers[] = {0x01, 0x01, 0x5e, 0x5e, 0x5e, 0x5e, 0x9c, 0xda, 0xda, 0xda};
+        uint8_t zhdr[2]                     = {0x78, zlib_headers[level]};
+        write_png_chunk(f, "IDAT", zhdr, 2);
+        adler = adler32(0, NULL, 0);
+        prev.resize((size_t)width * channel);
+    }
+
+    // Rows per band that keeps every thread busy
+    int band_rows() const {
+        return n_threads * 64;
+    }
+
+    // Compress and write the next count rows
+    bool write_rows(const uint8_t* rows, int count) {
+        if (!ok || count <= 0 || rows_written + count > height)
+            return ok = false;
+        int bytes   = width * channel;
+        int stripes = std::max(1, std::min(n_threads, count / 32));
+        std::vector<PNGStripe> out(stripes);
+        std::vector<char> stripe_ok(stripes, false);
+        std::vector<std::thread> threads;
+        for (int i = 0; i < stripes; i++) {
+            int y0    = (int)((int64_t)count * i / stripes);
+            int y1    = (int)((int64_t)count * (i + 1) / stripes);
+            auto work = [&, i, y0, y1] {
+                const uint8_t* before = y0 ? rows + (size_t)(y0 - 1) * bytes : (rows_written ? prev.data() : NULL);
+                stripe_ok[i]          = png_compress_stripe(rows + (size_t)y0 * bytes, before, y1 - y0, bytes, channel, level, out[i]);
+            };
+            if (i < stripes - 1)
+                threads.emplace_back(work);
+            else
+                work();
+        }
+        for (auto& thread : threads)
+            thread.join();
+
+        for (int i = 0; i < stripes; i++) {
+            if (!stripe_ok[i])
+                return ok = false;
+            adler = adler32_combine(adler, out[i].adler, out[i].len);
+            write_png_chunk(f, "IDAT", out[i].data.data(), out[i].data.size());
+        }
+        memcpy(prev.data(), rows + (size_t)(count - 1) * bytes, bytes);
+        rows_written += count;
+        return ok;
+    }
+
+    // End the stream; false if anything went wrong or rows are missing
+    bool finish() {
+        if (!ok || rows_written != height)
+            return false;
+        // An empty final stored block, then the zlib checksum
+        uint8_t trailer[9] = {0x01, 0x00, 0x00, 0xff, 0xff};
+        put_be32(trailer + 5, adler);
+        write_png_chunk(f, "IDAT", trailer, 9);
+        write_png_chunk(f, "IEND", NULL, 0);
+        return !ferror(f);
+    }
+
+private:
+    FILE* f;
+    uint32_t width, height;
+    int channel, level, n_threads;
+    uLong adler;
+    std::vector<uint8_t> prev;  // last row written, for filtering the next
+    uint32_t rows_written = 0;
+    bool ok               = true;
+};
+
+static bool write_png_zlib(FILE* f, const sd_image_t& image, const ImageFormat& format, const std::string& parameters) {
+    int n_threads = !format.threaded ? 1 : format.threads > 0 ? format.threads : (int)std::thread::hardware_concurrency();
+    PNGStreamWriter png(f, image.width, image.height, image.channel, format.level, n_threads, parameters);
+    size_t row_bytes = (size_t)image.width * image.channel;
+    for (uint32_t y = 0; y < image.height; y += png.band_rows()) {
+        int count = std::min((uint32_t)png.band_rows(), image.height - y);
+        if (!png.write_rows(image.data + y * row_bytes, count))
+            return false;
+    }
+    return png.finish();
+}
+
+static bool write_qoi(FILE* f, const sd_image_t& image) {
+    int channels = image.channel == 4 ? 4 : 3;
+    uint8_t header[14];
+    memcpy(header, "qoif", 4);
+    put_be32(header + 4, image.width);
+    put_be32(header + 8, image.height);
+    header[12] = channels;
+    header[13] = 0;
+    fwrite(header, 1, 14, f);
+
+    std::vector<uint8_t> out;
+    out.reserve((size_t)image.width * image.height * (channels + 1) / 2 + 8);
+    uint8_t index[64][4] = {{0}};
+    uint8_t px[4] = {0, 0, 0, 255}, prev[4] = {0, 0, 0, 255};
+    int run         = 0;
+    size_t n_pixels = (size_t)image.width * image.height;
+    for (size_t i = 0; i < n_pixels; i++) {
+        const uint8_t* src = image.data + i * image.channel;
+        if (image.channel < 3) {
+            px[0] = px[1] = px[2] = src[0];
+            px[3]                 = image.channel == 2 ? src[1] : 255;
+        } else {
+            memcpy(px, src, 3);
+            px[3] = image.channel == 4 ? src[3] : 255;
+        }
+
+        if (!memcmp(px, prev, 4)) {
+            if (++run == 62 || i + 1 == n_pixels) {
+                out.push_back(0xc0 | (run - 1));
+                run = 0;
+            }
+            continue;
+        }
+        if (run) {
+            out.push_back(0xc0 | (run - 1));
+            run = 0;
+        }
+
+        int hash = (px[0] * 3 + px[1] * 5 + px[2] * 7 + px[3] * 11) % 64;
+        if (!memcmp(index[hash], px, 4)) {
+            out.push_back(hash);
+        } else {
+            memcpy(index[hash], px, 4);
+            if (px[3] == prev[3]) {
+                int8_t dr = px[0] - prev[0], dg = px[1] - prev[1], db = px[2] - prev[2];
+                int8_t dr_dg = dr - dg, db_dg = db - dg;
+                if (dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1 && db >= -2 && db <= 1) {
+                    out.push_back(0x40 | (dr + 2) << 4 | (dg + 2) << 2 | (db + 2));
+                } else if (dg >= -32 && dg <= 31 && dr_dg >= -8 && dr_dg <= 7 && db_dg >= -8 && db_dg <= 7) {
+                    out.push_back(0x80 | (dg + 32));
+                    out.push_back((dr_dg + 8) << 4 | (db_dg + 8));
+                } else {
+                    out.push_back(0xfe);
+                    out.insert(out.end(), px, px + 3);
+                }
+            } else {
+                out.push_back(0xff);
+                out.insert(out.end(), px, px + 4);
+            }
+        }
+        memcpy(prev, px, 4);
+    }
+    static const uint8_t padding[] = {0, 0, 0, 0, 0, 0, 0, 1};
+    out.insert(out.end(), padding, padding + 8);
+    return fwrite(out.data(), 1, out.size(), f) == out.size();
+}
+
+static std::string pnm_header(const sd_image_t& image, bool pam) {
+    static const char* tuple_types[] = {"", "GRAYSCALE", "GRAYSCALE_ALPHA", "RGB", "RGB_ALPHA"};
+    char header[128];
+    if (!pam && (image.channel == 1 || image.channel == 3)) {
+        snprintf(header, sizeof(header), "P%d\n%u %u\n255\n", image.channel == 1 ? 5 : 6, image.width, image.height);
+    } else {
+        snprintf(header, sizeof(header), "P7\nWIDTH %u\nHEIGHT %u\nDEPTH %u\nMAXVAL 255\nTUPLTYPE %s\nENDHDR\n",
+                 image.width, image.height, image.channel, tuple_types[image.channel]);
+    }
+    return header;
+}
+
+static bool write_pnm(FILE* f, const sd_image_t& image, bool pam) {
+    std::string header = pnm_header(image, pam);
+    size_t size        = (size_t)image.width * image.height * image.channel;
+    return fwrite(header.data(), 1, header.size(), f) == header.size() && fwrite(image.data, 1, size, f) == size;
+}
+
+// Write the parameters beside an image whose format can't hold them
+static void write_sidecar(const std::string& path, const std::string& parameters) {
+    size_t last              = path.find_last_of(".");
+    std::string sidecar_path = (last != std::string::npos ? path.substr(0, last) : path) + ".json";
+    FILE* f                  = fopen(sidecar_path.c_str(), "wb");
+    if (f) {
+        fwrite(parameters.data(), 1, parameters.size(), f);
+        fclose(f);
+    }
+}
+
+/* Result images are encoded and written in the background, so the next
+ * operation can start as soon as the pixels exist. The writer takes ownership
+ * of the image data it's given. */
+struct ImageWriteJob {
+    std::string path;
+    sd_image_t image;
+    std::string parameters;
+    ImageFormat format;
+    std::function<void(const std::string&, bool)> on_saved;
+};
+
+static bool write_image(const ImageWriteJob& job) {
+    ImageFormat format = job.format;
+    if (format.type == FORMAT_PNG_STB && (size_t)job.image.width * job.image.height > 16 * 1024 * 1024)
+        format = ImageFormat{FORMAT_PNG, 8, true, job.format.threads};
+    if (format.type == FORMAT_PNG_STB) {
+        return stbi_write_png(job.path.c_str(), job.image.width, job.image.height, job.image.channel,
+                              job.image.data, 0, job.parameters.c_str());
+    }
+
+    FILE* f = fopen(job.path.c_str(), "wb");
+    if (!f)
+        return false;
+    bool ok;
+    switch (format.type) {
+        case FORMAT_QOI:
+            ok = write_qoi(f, job.image);
+            break;
+        case FORMAT_PPM:
+        case FORMAT_PAM:
+            ok = write_pnm(f, job.image, format.type == FORMAT_PAM);
+            break;
+        default:
+            ok = write_png_zlib(f, job.image, format, job.parameters);
+            break;
+    }
+    if (fclose(f))
+        ok = false;
+    if (ok && format.type != FORMAT_PNG)
+        write_sidecar(job.path, job.parameters);
+    return ok;
+}
+
+static void finish_image_write(ImageWriteJob& job) {
+    auto start = std::chrono::steady_clock::now();
+    bool ok    = write_image(job);
+    event_log.emit("write", {{"path", job.path}, {"ok", ok}, {"seconds", seconds_since(start)}});
+    if (ok)
+        printf("save result image to '%s'\n", job.path.c_str());
+    else
+        fprintf(stderr, "save result image to '%s' failed\n", job.path.c_str());
+    if (job.on_saved)
+        job.on_saved(job.path, ok);
+    free(job.image.data);
+    job.image.data = NULL;
+}
+
+class ImageWriter {
+public:
+    ~ImageWriter() {
+        finish();
+    }
+
+    // (Re)start with this many threads, 0 to write synchronously
+    void configure(int n_threads, int max_queue) {
+        if (n_threads == (int)threads.size() && max_queue == this->max_queue)
+            return;
+        finish();
+        this->max_queue = max_queue > 0 ? max_queue : 1;
+        stopping        = false;
+        for (int i = 0; i < n_threads; i++)
+            threads.emplace_back(&ImageWriter::run, this);
+    }
+
+    // Queue an image, waiting if the queue is full
+    void push(ImageWriteJob job) {
+        if (threads.size() == 0) {
+            finish_image_write(job);
+            return;
+        }
+        std::unique_lock<std::mutex> guard(lock);
+        cond.wait(guard, [this] { return (int)queue.size() < max_queue; });
+        queue.push_back(std::move(job));
+        cond.notify_all();
+    }
+
+    // Wait for everything queued so far to be written
+    void wait() {
+        std::unique_lock<std::mutex> guard(lock);
+        cond.wait(guard, [this] { return queue.size() == 0 && active == 0; });
+    }
+
+    void finish() {
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            stopping = true;
+            cond.notify_all();
+        }
+        for (auto& thread : threads)
+            thread.join();
+        threads.clear();
+    }
+
+private:
+    void run() {
+        std::unique_lock<std::mutex> guard(lock);
+        while (true) {
+            cond.wait(guard, [this] { return queue.size() > 0 || stopping; });
+            if (queue.size() == 0)
+                break;
+            ImageWriteJob job = std::move(queue.front());
+            queue.pop_front();
+            active++;
+            cond.notify_all();
+
+            guard.unlock();
+            finish_image_write(job);
+            guard.lock();
+
+            active--;
+            cond.notify_all();
+        }
+    }
+
+    std::mutex lock;
+    std::condition_variable cond;
+    std::deque<ImageWriteJob> queue;
+    std::vector<std::thread> threads;
+    int max_queue = 1;
+    int active    = 0;
+    bool stopping = false;
+};
+
+static ImageWriter image_writer;
+
+/* Pixel buffers for input images, resizing and previews come from a pool of
+ * size classes (four per power of two), so long runs reuse the same few
+ * multi-megabyte blocks instead of going back to the allocator each time.
+ * A PixelBuffer is a shared handle; the block returns to the pool when the
+ * last handle goes. */
+class PixelBuffer {
+public:
+    uint8_t* data() const {
+        return ptr.get();
+    }
+    size_t size() const {
+        return len;
+    }
+
+private:
+    friend class BufferPool;
+    std::shared_ptr<uint8_t> ptr;
+    size_t len = 0;
+};
+
+class BufferPool {
+public:
+    ~BufferPool() {
+        for (auto& cls : idle) {
+            for (auto block : cls.second)
+                free(block);
+        }
+    }
+
+    PixelBuffer get(size_t size) {
+        size_t cls    = size_class(size);
+        uint8_t* block = NULL;
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            auto& blocks = idle[cls];
+            if (blocks.size() > 0) {
+                block = blocks.back();
+                blocks.pop_back();
+                idle_size -= cls;
+                reused++;
+            }
+            in_use += cls;
+            peak = std::max(peak, in_use);
+            gets++;
+        }
+        if (!block)
+            block = (uint8_t*)malloc(cls);
+        if (!block)
+            throw std::bad_alloc();
+        PixelBuffer buf;
+        buf.ptr.reset(block, [this, cls](uint8_t* block) { put(block, cls); });
+        buf.len = size;
+        return buf;
+    }
+
+    // Wrap a malloc'd buffer from elsewhere, freeing it rather than pooling it
+    static PixelBuffer adopt(uint8_t* data, size_t size) {
+        PixelBuffer buf;
+        buf.ptr.reset(data, free);
+        buf.len = size;
+        return buf;
+    }
+
+    size_t in_use_size() {
+        std::lock_guard<std::mutex> guard(lock);
+        return in_use;
+    }
+
+    void print_stats() {
+        std::lock_guard<std::mutex> guard(lock);
+        printf("pixel buffers: %.1fMB in use (peak %.1fMB), %.1fMB idle, %llu of %llu requests reused\n",
+               in_use / 1048576.0, peak / 1048576.0, idle_size / 1048576.0,
+               (unsigned long long)reused, (unsigned long long)gets);
+    }
+
+private:
+    static size_t size_class(size_t size) {
+        size_t step = 4096;
+        while (step * 8 <= size)
+            step *= 2;
+        return (size + step - 1) / step * step;
+    }
+
+    void put(uint8_t* block, size_t cls) {
+        std::lock_guard<std::mutex> guard(lock);
+        in_use -= cls;
+        if (idle_size + cls > max_idle) {
+            free(block);
+            return;
+        }
+        idle[cls].push_back(block);
+        idle_size += cls;
+    }
+
+    static const size_t max_idle = 256 * 1024 * 1024;
+
+    std::mutex lock;
+    std::map<size_t, std::vector<uint8_t*>> idle;
+    size_t idle_size = 0;
+    size_t in_use    = 0;
+    size_t peak      = 0;
+    uint64_t gets    = 0;
+    uint64_t reused  = 0;
+};
+
+static BufferPool buffer_pool;
+
+/* Previews go to one long-lived viewer rather than a new process per image.
+ * The target is either a FIFO, which is written to whenever something is
+ * reading it, or a command, which is started once and fed a stream of binary
+ * PPM frames on its standard input (e.g. "ffplay -f image2pipe -c:v ppm -").
+ * Frames are sent from their own thread as soon as they're decoded, and if
+ * the viewer falls behind, the oldest are dropped. Writes never block: a
+ * frame that finds the pipe full is dropped, and one already partly written
+ * is finished as the viewer makes room, so a stalled viewer holds up neither
+ * the thread nor stopping it. */
+class PreviewSink {
+public:
+    ~PreviewSink() {
+        configure("");
+    }
+
+    /* Show frames on target: "cmd:COMMAND" to run a viewer, or the path of
+     * a FIFO; "" to stop. False, leaving it unchanged, if target is neither. */
+    bool configure(const std::string& target) {
+        struct stat st;
+        if (target != "" && target.compare(0, 4, "cmd:") != 0 &&
+            (stat(target.c_str(), &st) != 0 || !S_ISFIFO(st.st_mode))) {
+            fprintf(stderr, "preview target %s isn't a FIFO (use cmd:COMMAND to run a viewer)\n", target.c_str());
+            return false;
+        }
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            if (target == this->target && (target == "" || thread.joinable()))
+                return true;
+            stopping = true;
+            cond.notify_all();
+        }
+        if (thread.joinable())
+            thread.join();
+        close_output();
+        std::lock_guard<std::mutex> guard(lock);
+        frames.clear();
+        this->target = target;
+        stopping     = false;
+        if (target != "") {
+            signal(SIGPIPE, SIG_IGN);
+            thread = std::thread(&PreviewSink::run, this);
+        }
+        return true;
+    }
+
+    bool active() {
+        std::lock_guard<std::mutex> guard(lock);
+        return target != "";
+    }
+
+    // Queue a copy of this image for display
+    void push(const sd_image_t& image) {
+        std::lock_guard<std::mutex> guard(lock);
+        if (target == "" || image.data == NULL)
+            return;
+        Frame frame;
+        frame.width   = image.width;
+        frame.height  = image.height;
+        frame.channel = image.channel;
+        frame.data    = buffer_pool.get((size_t)image.width * image.height * image.channel);
+        memcpy(frame.data.data(), image.data, frame.data.size());
+        if (frames.size() >= max_frames)
+            frames.pop_front();
+        frames.push_back(std::move(frame));
+        cond.notify_all();
+    }
+
+private:
+    struct Frame {
+        uint32_t width, height, channel;
+        PixelBuffer data;
+    };
+
+    void run() {
+        std::unique_lock<std::mutex> guard(lock);
+        Frame frame;
+        std::string header;
+        size_t sent = 0, size = 0;  // of header and frame, while one is being written
+        while (!stopping) {
+            if (size == 0) {
+                cond.wait(guard, [this] { return frames.size() > 0 || stopping; });
+                if (stopping)
+                    break;
+                frame = std::move(frames.front());
+                frames.pop_front();
+                sd_image_t image = {frame.width, frame.height, frame.channel, frame.data.data()};
+                header           = pnm_header(image, false);
+                size             = header.size() + frame.data.size();
+                sent             = 0;
+            }
+
+            guard.unlock();
+            if (!open_output()) {
+                size = 0;  // no reader means nobody is watching
+            } else {
+                struct iovec iov[2];
+                int n = 0;
+                if (sent < header.size())
+                    iov[n++] = {(void*)(header.data() + sent), header.size() - sent};
+                size_t off = sent > header.size() ? sent - header.size() : 0;
+                iov[n++]   = {(void*)(frame.data.data() + off), frame.data.size() - off};
+                ssize_t ret = writev(fd, iov, n);
+                if (ret > 0) {
+                    sent += ret;
+                } else if (ret < 0 && errno == EAGAIN && sent == 0) {
+                    size = 0;
+                } else if (ret < 0 && errno == EAGAIN) {
+                    // Partway through a frame: wait a while for room, then check for stopping
+                    struct pollfd pfd = {fd, POLLOUT, 0};
+                    poll(&pfd, 1, 100);
+                } else if (ret < 0 && errno != EINTR) {
+                    close_output();
+                    size = 0;
+                }
+                if (sent == size)
+                    size = 0;
+            }
+            guard.lock();
+        }
+    }
+
+    bool open_output() {
+        if (fd >= 0)
+            return true;
+        if (target.compare(0, 4, "cmd:") != 0) {
+            struct stat st;
+            if (stat(target.c_str(), &st) != 0 || !S_ISFIFO(st.st_mode))
+                return false;
+            fd = open(target.c_str(), O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+            return fd >= 0;
+        }
+
+        int fds[2];
+        if (pipe(fds) < 0)
+            return false;
+        child = fork();
+        if (child == 0) {
+            // Its own process group, so that killing it takes whatever the shell started
+            setpgid(0, 0);
+            dup2(fds[0], 0);
+            close(fds[0]);
+            close(fds[1]);
+            execl("/bin/sh", "sh", "-c", target.c_str() + 4, (char*)NULL);
+            _exit(127);
+        }
+        close(fds[0]);
+        if (child < 0) {
+            close(fds[1]);
+            child = 0;
+            return false;
+        }
+        fd = fds[1];
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+        fcntl(fd, F_SETFL, O_NONBLOCK);
+        // Room for a whole frame, where allowed, so frames are dropped whole
+        fcntl(fd, F_SETPIPE_SZ, 1 << 20);
+        return true;
+    }
+
+    /* If the viewer went away, it's restarted with the next frame. One that
+     * doesn't exit soon after its input closes is killed. */
+    void close_output() {
+        if (fd >= 0)
+            close(fd);
+        fd = -1;
+        if (child > 0) {
+            int waited = 0;
+            while (waitpid(child, NULL, WNOHANG) == 0) {
+                if (waited++ == 100) {
+                    kill(-child, SIGKILL);
+                    waitpid(child, NULL, 0);
+                    break;
+                }
+                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            }
+        }
+        child = 0;
+    }
+
+    static const size_t max_frames = 4;
+
+    std::mutex lock;
+    std::condition_variable cond;
+    std::deque<Frame> frames;
+    std::thread thread;
+    std::string target;
+    int fd        = -1;
+    pid_t child   = 0;
+    bool stopping = false;
+};
+
+static PreviewSink preview_sink;
+
+/* Separable resampler for input images. Each pass works a row at a time,
+ * with rows split across threads, and the vertical pass is a weighted sum of
+ * whole contiguous float rows, which the compiler vectorizes for whatever
+ * SIMD the target has. Filter tables depend only on the lengths involved, so
+ * they're kept for the next image of the same size. Colour images are
+ * filtered in linear light. */
+struct ResizeKernel {
+    int taps = 0;
+    std::vector<int> index;      // taps source samples per output sample
+    std::vector<float> weights;  // and their weights, summing to 1
+};
+
+static float resize_filter_support(ResizeFilter filter) {
+    static const float support[] = {0.5f, 1.0f, 2.0f, 3.0f};
+    return support[filter];
+}
+
+static float resize_filter_weight(ResizeFilter filter, float x) {
+    x = fabsf(x);
+    switch (filter) {
+        case RESIZE_BOX:
+            return x <= 0.5f ? 1.0f : 0.0f;
+        case RESIZE_TRIANGLE:
+            return x < 1.0f ? 1.0f - x : 0.0f;
+        case RESIZE_CATMULL_ROM:
+            if (x < 1.0f)
+                return (1.5f * x - 2.5f) * x * x + 1.0f;
+            if (x < 2.0f)
+                return ((-0.5f * x + 2.5f) * x - 4.0f) * x + 2.0f;
+            return 0.0f;
+        case RESIZE_LANCZOS:
+            if (x < 1e-6f)
+                return 1.0f;
+            if (x < 3.0f)
+                return 3.0f * sinf((float)M_PI * x) * sinf((float)M_PI * x / 3.0f) / ((float)(M_PI * M_PI) * x * x);
+            return 0.0f;
+        default:
+            return 0.0f;
+    }
+}
+
+// Kernel mapping src_len samples starting at src_off onto dst_len samples
+static std::shared_ptr<const ResizeKernel> resize_kernel(int src_off, int src_len, int dst_len, ResizeFilter filter) {
+    static std::mutex lock;
+    static std::map<std::string, std::shared_ptr<const ResizeKernel>> kernels;
+    std::string key = std::to_string(src_off) + ":" + std::to_string(src_len) + ">" +
+                      std::to_string(dst_len) + ":" + resize_filter_str[filter];
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        auto it = kernels.find(key);
+        if (it != kernels.end())
+            return it->second;
+    }
+
+    auto kernel    = std::make_shared<ResizeKernel>();
+    float scale    = (float)dst_len / src_len;
+    float stretch  = scale < 1.0f ? 1.0f / scale : 1.0f;  // widen the filter when shrinking
+    float support  = resize_filter_support(filter) * stretch;
+    kernel->taps   = (int)ceilf(support * 2.0f) + 1;
+    kernel->index.resize((size_t)dst_len * kernel->taps);
+    kernel->weights.resize((size_t)dst_len * kernel->taps);
+    for (int i = 0; i < dst_len; i++) {
+        float center = (i + 0.5f) / scale;
+        int first    = (int)floorf(center - support);
+        int* index   = &kernel->index[(size_t)i * kernel->taps];
+        float* w     = &kernel->weights[(size_t)i * kernel->taps];
+        float total  = 0.0f;
+        for (int k = 0; k < kernel->taps; k++) {
+            int j    = first + k;
+            w[k]     = resize_filter_weight(filter, (j + 0.5f - center) / stretch);
+            index[k] = src_off + std::min(std::max(j, 0), src_len - 1);
+            total += w[k];
+        }
+        if (total == 0.0f) {
+            // Only when upscaling with a box: take the nearest sample
+            w[0]     = 1.0f;
+            index[0] = src_off + std::min(std::max((int)center, 0), src_len - 1);
+            for (int k = 1; k < kernel->taps; k++)
+                w[k] = 0.0f;
+            total = 1.0f;
+        }
+        for (int k = 0; k < kernel->taps; k++)
+            w[k] /= total;
+    }
+
+    std::lock_guard<std::mutex> guard(lock);
+    if (kernels.size() >= 32)
+        kernels.clear();
+    kernels[key] = kernel;
+    return kernel;
+}
+
+static const float* srgb_to_linear_table() {
+    static float table[256];
+    static std::once_flag once;
+    std::call_once(once, [] {
+        for (int i = 0; i < 256; i++) {
+            float c  = i / 255.0f;
+            table[i] = c <= 0.04045f ? c / 12.92f : powf((c + 0.055f) / 1.055f, 2.4f);
+        }
+    });
+    return table;
+}
+
+static const uint8_t* linear_to_srgb_table() {
+    static uint8_t table[4096];
+    static std::once_flag once;
+    std::call_once(once, [] {
+        for (int i = 0; i < 4096; i++) {
+            float c  = (i + 0.5f) / 4096.0f;
+            c        = c <= 0.0031308f ? c * 12.92f : 1.055f * powf(c, 1.0f / 2.4f) - 0.055f;
+            table[i] = (uint8_t)std::min(std::max(c * 255.0f + 0.5f, 0.0f), 255.0f);
+        }
+    });
+    return table;
+}
+
+// Run fn(begin, end) over [0, n) on up to n_threads threads
+static void parallel_rows(int n, int n_threads, const std::function<void(int, int)>& fn) {
+    n_threads = std::max(1, std::min(n_threads, n / 16));
+    if (n_threads == 1) {
+        fn(0, n);
+        return;
+    }
+    std::vector<std::thread> threads;
+    for (int t = 0; t < n_threads; t++)
+        threads.emplace_back(fn, (int)((int64_t)n * t / n_threads), (int)((int64_t)n * (t + 1) / n_threads));
+    for (auto& thread : threads)
+        thread.join();
+}
+
+static void resize_image(const uint8_t* src, int src_w, int src_h,
+                         uint8_t* dst, int dst_w, int dst_h, int channel,
+                         ResizeFilter filter, ResizeFit fit, bool srgb, int n_threads) {
+    // Source and destination rectangles
+    int sx = 0, sy = 0, sw = src_w, sh = src_h;
+    int dx = 0, dy = 0, dw = dst_w, dh = dst_h;
+    if (fit == FIT_CROP) {
+        if ((int64_t)src_w * dst_h > (int64_t)src_h * dst_w)
+            sw = std::max(1, (int)((int64_t)src_h * dst_w / dst_h));
+        else
+            sh = std::max(1, (int)((int64_t)src_w * dst_h / dst_w));
+        sx = (src_w - sw) / 2;
+        sy = (src_h - sh) / 2;
+    } else if (fit == FIT_PAD) {
+        if ((int64_t)src_w * dst_h > (int64_t)src_h * dst_w)
+            dh = std::max(1, (int)((int64_t)src_h * dst_w / src_w));
+        else
+            dw = std::max(1, (int)((int64_t)src_w * dst_h / src_h));
+        dx = (dst_w - dw) / 2;
+        dy = (dst_h - dh) / 2;
+        memset(dst, 0, (size_t)dst_w * dst_h * channel);
+    }
+
+    auto hkernel            = resize_kernel(sx, sw, dw, filter);
+    auto vkernel            = resize_kernel(0, sh, dh, filter);
+    const float* to_linear  = srgb_to_linear_table();
+    const uint8_t* to_srgb  = linear_to_srgb_table();
+    size_t row              = (size_t)dw * channel;
+    PixelBuffer tmp_buf     = buffer_pool.get((size_t)sh * row * sizeof(float));
+    float* tmp              = (float*)tmp_buf.data();
+
+    // Horizontal pass, over the source rows in use
+    parallel_rows(sh, n_threads, [&](int begin, int end) {
+        std::vector<float> in((size_t)src_w * channel);
+        for (int y = begin; y < end; y++) {
+            const uint8_t* line = src + ((size_t)(sy + y) * src_w) * channel;
+            for (size_t i = 0; i < in.size(); i++)
+                in[i] = srgb ? to_linear[line[i]] : line[i] / 255.0f;
+            float* out = &tmp[(size_t)y * row];
+            for (int x = 0; x < dw; x++) {
+                const int* index = &hkernel->index[(size_t)x * hkernel->taps];
+                const float* w   = &hkernel->weights[(size_t)x * hkernel->taps];
+                for (int c = 0; c < channel; c++) {
+                    float sum = 0.0f;
+                    for (int k = 0; k < hkernel->taps; k++)
+                        sum += w[k] * in[(size_t)index[k] * channel + c];
+                    out[(size_t)x * channel + c] = sum;
+                }
+            }
+        }
+    });
+
+    // Vertical pass, into the destination rectangle
+    parallel_rows(dh, n_threads, [&](int begin, int end) {
+        std::vector<float> sum(row);
+        for (int y = begin; y < end; y++) {
+            const int* index = &vkernel->index[(size_t)y * vkernel->taps];
+            const float* w   = &vkernel->weights[(size_t)y * vkernel->taps];
+            std::fill(sum.begin(), sum.end(), 0.0f);
+            for (int k = 0; k < vkernel->taps; k++) {
+                const float* in = &tmp[(size_t)index[k] * row];
+                float weight    = w[k];
+                if (weight == 0.0f)
+                    continue;
+                for (size_t i = 0; i < row; i++)
+                    sum[i] += weight * in[i];
+            }
+            uint8_t* out = dst + ((size_t)(dy + y) * dst_w + dx) * channel;
+            for (size_t i = 0; i < row; i++) {
+                float v = std::min(std::max(sum[i], 0.0f), 1.0f);
+                out[i]  = srgb ? to_srgb[std::min((int)(v * 4096.0f), 4095)] : (uint8_t)(v * 255.0f + 0.5f);
+            }
+        }
+    });
+}
+
+/* Decoded input images are cached, so re-rolls against the same init image,
+ * mask or control image don't decode and resize it again. Entries are keyed
+ * by the file's identity and modification time as well as its path, so an
+ * edited file is reloaded. They're shared read-only: evicting one only drops
+ * the cache's reference. */
+struct DecodedImage {
+    int width        = 0;
+    int height       = 0;
+    int channel      = 0;
+    int src_channels = 0;  // as stored in the file
+    PixelBuffer data;
+};
+
+/* Control image preprocessors. Their output depends only on the image and
+ * their arguments, so it's cached alongside the decoded image. Each is a
+ * function from an RGB image to an RGB image of the same size. */
+struct ControlPreprocessor {
+    const char* name;
+    std::vector<float> args;
+    void (*run)(const DecodedImage& in, const std::vector<float>& args, uint8_t* out, int n_threads);
+};
+
+/* Round to the nearest half-precision value, ties to even. The library's
+ * convolutions run in f16, so their inputs and kernels are rounded so. */
+static float round_to_half(float f) {
+    float a = fabsf(f);
+    if (!(a < 65520.0f))
+        return f;
+    float r;
+    if (a < 6.103515625e-05f) {
+        // Subnormal halves are multiples of 2^-24
+        r = nearbyintf(a * 16777216.0f) / 16777216.0f;
+    } else {
+        uint32_t bits;
+        memcpy(&bits, &a, sizeof(bits));
+        bits += 0x0fff + ((bits >> 13) & 1);
+        bits &= ~0x1fffu;
+        memcpy(&r, &bits, sizeof(r));
+    }
+    return f < 0.0f ? -r : r;
+}
+
+/* Canny edge detection, reproducing stable-diffusion.cpp's preprocess_canny
+ * (grayscale, 5x5 Gaussian, Sobel, non-maximum suppression, thresholding and
+ * one pass of hysteresis), with every stage but the hysteresis split into
+ * row bands across threads. Its quirks are kept, so that edge maps don't
+ * change: every direction of 157.5 degrees or less is compared with the
+ * pixels above and below, and the rest are kept only at the maximum; the
+ * threshold is relative to a maximum that includes the blurred image left in
+ * the border; values under the low threshold are left as they are; and the
+ * hysteresis works in place, looking at six of the eight neighbours.
+ * Arguments: high threshold, low threshold, weak, strong, inverse. */
+static void canny_preprocessor(const DecodedImage& in, const std::vector<float>& args, uint8_t* out, int n_threads) {
+    int w = in.width, h = in.height;
+    size_t n = (size_t)w * h;
+    float high_threshold = args[0], low_threshold = args[1], weak = args[2], strong = args[3];
+    bool inverse = args[4] != 0.0f;
+
+    PixelBuffer buf = buffer_pool.get(n * 4 * sizeof(float));
+    float* img      = (float*)buf.data();  // grayscale, then blurred, then edges
+    float* half     = img + n;             // the convolutions' input
+    float* grad     = half + n;
+    float* angle    = grad + n;
+
+    // Grayscale
+    const uint8_t* rgb = in.data.data();
+    parallel_rows(h, n_threads, [&](int begin, int end) {
+        for (size_t i = (size_t)begin * w; i < (size_t)end * w; i++) {
+            img[i]  = 0.2989f * (rgb[i * 3] / 255.0f) + 0.5870f * (rgb[i * 3 + 1] / 255.0f) + 0.1140f * (rgb[i * 3 + 2] / 255.0f);
+            half[i] = round_to_half(img[i]);
+        }
+    });
+
+    // Cross-correlation of half with a kernel, with zero padding
+    auto convolve = [&](const float* kernel, int size, int x, int y) {
+        int mid    = size / 2;
+        double sum = 0.0;
+        for (int ky = 0; ky < size; ky++) {
+            int sy = y + ky - mid;
+            if (sy < 0 || sy >= h)
+                continue;
+            for (int kx = 0; kx < size; kx++) {
+                int sx = x + kx - mid;
+                if (sx >= 0 && sx < w)
+                    sum += kernel[ky * size + kx] * half[(size_t)sy * w + sx];
+            }
+        }
+        return (float)sum;
+    };
+
+    // Gaussian blur, sigma 1.4, with the library's unnormalized 5x5 kernel
+    float gaussian[25];
+    float sigma  = 1.4f;
+    float normal = 1.f / (2.0f * M_PI * powf(sigma, 2.0f));
+    for (int y = 0; y < 5; y++) {
+        for (int x = 0; x < 5; x++) {
+            float gx            = -2 + y;
+            float gy            = -2 + x;
+            gaussian[y * 5 + x] = round_to_half(expf(-((gx * gx + gy * gy) / (2.0f * powf(sigma, 2.0f)))) * normal);
+        }
+    }
+    parallel_rows(h, n_threads, [&](int begin, int end) {
+        for (int y = begin; y < end; y++) {
+            for (int x = 0; x < w; x++)
+                img[(size_t)y * w + x] = convolve(gaussian, 5, x, y);
+        }
+    });
+    parallel_rows(h, n_threads, [&](int begin, int end) {
+        for (size_t i = (size_t)begin * w; i < (size_t)end * w; i++)
+            half[i] = round_to_half(img[i]);
+    });
+
+    // Sobel gradient magnitude and direction
+    static const float sobel_x[9] = {-1, 0, 1, -2, 0, 2, -1, 0, 1};
+    static const float sobel_y[9] = {1, 2, 1, 0, 0, 0, -1, -2, -1};
+    std::mutex max_lock;
+    float max_grad = -INFINITY;
+    parallel_rows(h, n_threads, [&](int begin, int end) {
+        float local_max = -INFINITY;
+        for (int y = begin; y < end; y++) {
+            for (int x = 0; x < w; x++) {
+                float gx  = convolve(sobel_x, 3, x, y);
+                float gy  = convolve(sobel_y, 3, x, y);
+                size_t i  = (size_t)y * w + x;
+                grad[i]   = sqrtf(gx * gx + gy * gy);
+                angle[i]  = atan2f(gy, gx);
+                local_max = std::max(local_max, grad[i]);
+            }
+        }
+        std::lock_guard<std::mutex> guard(max_lock);
+        max_grad = std::max(max_grad, local_max);
+    });
+
+    // Non-maximum suppression on the normalized gradient, inside the border
+    float scale = 1.0f / max_grad;
+    parallel_rows(h, n_threads, [&](int begin, int end) {
+        for (int y = std::max(begin, 1); y < std::min(end, h - 1); y++) {
+            for (int x = 1; x < w - 1; x++) {
+                size_t i = (size_t)y * w + x;
+                float a  = angle[i] * 180.0f / M_PI;
+                if (a < 0.0f)
+                    a += 180.0f;
+                float q = 1.0f, r = 1.0f;
+                if (a <= 157.5f) {
+                    q = grad[i + w] * scale;
+                    r = grad[i - w] * scale;
+                }
+                float cur = grad[i] * scale;
+                img[i]    = cur >= q && cur >= r ? cur : 0.0f;
+            }
+        }
+    });
+
+    // Double threshold, clearing a 3 pixel border
+    float max_edge = -INFINITY;
+    parallel_rows(h, n_threads, [&](int begin, int end) {
+        float local_max = -INFINITY;
+        for (size_t i = (size_t)begin * w; i < (size_t)end * w; i++)
+            local_max = std::max(local_max, img[i]);
+        std::lock_guard<std::mutex> guard(max_lock);
+        max_edge = std::max(max_edge, local_max);
+    });
+    float ht = max_edge * high_threshold;
+    float lt = ht * low_threshold;
+    parallel_rows(h, n_threads, [&](int begin, int end) {
+        for (int y = begin; y < end; y++) {
+            for (int x = 0; x < w; x++) {
+                size_t i = (size_t)y * w + x;
+                float v  = img[i];
+                if (v >= ht)
+                    v = strong;
+                else if (v <= ht && v >= lt)
+                    v = weak;
+                if (x < 3 || x > w - 3 || y < 3 || y > h - 3)
+                    v = 0.0f;
+                img[i] = v;
+            }
+        }
+    });
+
+    // Hysteresis, in raster order, so pixels already promoted count
+    for (int y = 1; y < h - 1; y++) {
+        for (int x = 1; x < w - 1; x++) {
+            float* p = img + (size_t)y * w + x;
+            if (*p != weak)
+                continue;
+            bool near_strong = p[-w + 1] == strong || p[1] == strong || p[-w] == strong ||
+                               p[w] == strong || p[-w - 1] == strong || p[-1] == strong;
+            *p = near_strong ? strong : 0.0f;
+        }
+    }
+
+    parallel_rows(h, n_threads, [&](int begin, int end) {
+        for (size_t i = (size_t)begin * w; i < (size_t)end * w; i++) {
+            float v = inverse ? 1.0f - img[i] : img[i];
+            uint8_t c      = (uint8_t)(std::min(std::max(v, 0.0f), 1.0f) * 255.0f);
+            out[i * 3]     = c;
+            out[i * 3 + 1] = c;
+            out[i * 3 + 2] = c;
+        }
+    });
+}
+
+static const ControlPreprocessor control_preprocessors[] = {
+    {"canny", {0.08f, 0.08f, 0.8f, 1.0f, 0.0f}, canny_preprocessor},
+};
+
+class ImageCache {
+public:
+    /* Load path with this many channels, resized to width x height unless
+     * those are 0. Returns NULL if it can't be loaded. */
+    std::shared_ptr<const DecodedImage> load(const std::string& path, int channel, int width = 0, int height = 0,
+                                             ResizeFilter filter = RESIZE_BOX, ResizeFit fit = FIT_STRETCH, int n_threads = 1) {
+        std::string native_key = file_key(path, channel);
+        if (native_key == "")
+            return nullptr;
+        std::stringstream key;
+        key << native_key << '|' << width << 'x' << height << '|' << resize_filter_str[filter] << '|' << resize_fit_str[fit];
+        std::string sized_key = key.str();
+
+        if (auto image = find(width > 0 && height > 0 ? sized_key : native_key))
+            return image;
+
+        std::shared_ptr<DecodedImage> image;
+        auto native = find(native_key);
+        if (!native) {
+            int w = 0, h = 0, c = 0;
+            uint8_t* data = stbi_load(path.c_str(), &w, &h, &c, channel);
+            if (data == NULL)
+                return nullptr;
+            image               = std::make_shared<DecodedImage>();
+            image->width        = w;
+            image->height       = h;
+            image->channel      = channel;
+            image->src_channels = c;
+            image->data         = BufferPool::adopt(data, (size_t)w * h * channel);
+            insert(native_key, image);
+            native = image;
+        }
+        if (width <= 0 || height <= 0 || (native->width == width && native->height == height))
+            return native;
+
+        printf("resize input image from %dx%d to %dx%d\n", native->width, native->height, width, height);
+        image               = std::make_shared<DecodedImage>();
+        image->width        = width;
+        image->height       = height;
+        image->channel      = channel;
+        image->src_channels = native->src_channels;
+        image->data         = buffer_pool.get((size_t)width * height * channel);
+        resize_image(native->data.data(), native->width, native->height,
+                     image->data.data(), width, height, channel,
+                     filter, fit, channel >= 3, n_threads);
+        insert(sized_key, image);
+        return image;
+    }
+
+    // Load path as RGB and run a preprocessor over it
+    std::shared_ptr<const DecodedImage> preprocess(const std::string& path, const ControlPreprocessor& pre, int n_threads) {
+        std::string native_key = file_key(path, 3);
+        if (native_key == "")
+            return nullptr;
+        std::stringstream key;
+        key << native_key << '|' << pre.name;
+        for (float arg : pre.args)
+            key << ',' << arg;
+        if (auto image = find(key.str()))
+            return image;
+
+        auto native = load(path, 3);
+        if (!native)
+            return nullptr;
+        auto image          = std::make_shared<DecodedImage>(*native);
+        image->data         = buffer_pool.get(native->data.size());
+        pre.run(*native, pre.args, image->data.data(), n_threads);
+        insert(key.str(), image);
+        return image;
+    }
+
+    void set_max_size(size_t bytes) {
+        std::lock_guard<std::mutex> guard(lock);
+        max_size = bytes;
+        trim();
+    }
+
+private:
+    struct Entry {
+        std::string key;
+        std::shared_ptr<const DecodedImage> image;
+    };
+
+    // Identifies this version of the file, or "" if it doesn't exist
+    static std::string file_key(const std::string& path, int channel) {
+        struct stat st;
+        if (stat(path.c_str(), &st) != 0)
+            return "";
+        std::stringstream key;
+        key << path << '|' << st.st_dev << ':' << st.st_ino << '|' << st.st_size << '|'
+            << st.st_mtim.tv_sec << '.' << st.st_mtim.tv_nsec << '|' << channel;
+        return key.str();
+    }
+
+    std::shared_ptr<const DecodedImage> find(const std::string& key) {
+        std::lock_guard<std::mutex> guard(lock);
+        for (auto it = entries.begin(); it != entries.end(); it++) {
+            if (it->key == key) {
+                entries.splice(entries.begin(), entries, it);
+                return it->image;
+            }
+        }
+        return nullptr;
+    }
+
+    void insert(const std::string& key, std::shared_ptr<const DecodedImage> image) {
+        std::lock_guard<std::mutex> guard(lock);
+        size += image->data.size();
+        entries.push_front(Entry{key, image});
+        trim();
+    }
+
+    void trim() {
+        while (size > max_size && entries.size() > 0) {
+            size -= entries.back().image->data.size();
+            entries.pop_back();
+        }
+    }
+
+    std::mutex lock;
+    std::list<Entry> entries;  // most recently used first
+    size_t size     = 0;
+    size_t max_size = 0;
+};
+
+static ImageCache image_cache;
+
+static std::shared_ptr<const DecodedImage> make_opaque_mask(int width, int height) {
+    auto image          = std::make_shared<DecodedImage>();
+    image->width        = width;
+    image->height       = height;
+    image->channel      = 1;
+    image->src_channels = 1;
+    image->data         = buffer_pool.get((size_t)width * height);
+    memset(image->data.data(), 255, image->data.size());
+    return image;
+}
+
+// All-opaque mask for img2img without one, shared by every job at that size
+static std::shared_ptr<const DecodedImage> opaque_mask(int width, int height) {
+    static std::mutex lock;
+    static std::map<std::pair<int, int>, std::shared_ptr<const DecodedImage>> masks;
+    std::lock_guard<std::mutex> guard(lock);
+    auto& mask = masks[std::make_pair(width, height)];
+    if (!mask)
+        mask = make_opaque_mask(width, height);
+    return mask;
+}
+
+int perform_op(SDParams &params,
+               std::function<void(const std::string&, bool)> on_saved = nullptr,
+               struct OpReport* report                             = nullptr);
+
+// Index of name in a table of names, or -1
+static int find_str(const char* const* strs, int count, const std::string& name) {
+    for (int i = 0; i < count; i++) {
+        if (name == strs[i])
+            return i;
+    }
+    return -1;
+}
+
+/* Index of the next free suffix for each output name prefix, so a name can
+ * be picked without probing. The directory is scanned once, on first use;
+ * names taken by other processes since then are skipped over when claiming
+ * them fails. */
+class OutputIndex {
+public:
+    // Claim a name of the form <prefix><N><ext>
+    std::string claim(const std::string& dir, const std::string& prefix, const std::string& ext) {
+        std::lock_guard<std::mutex> guard(lock);
+        if (!scanned.count(dir)) {
+            scan(dir);
+            scanned[dir] = true;
+        }
+        unsigned int& next = suffixes[dir + "/" + prefix + "|" + ext];
+        while (true) {
+            std::string path = dir + "/" + prefix + std::to_string(next) + ext;
+            next++;
+            int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0666);
+            if (fd >= 0) {
+                close(fd);
+                return path;
+            }
+            if (errno != EEXIST)
+                return path;  // let the write report the failure
+        }
+    }
+
+private:
+    void scan(const std::string& dir) {
+        DIR* d = opendir(dir.c_str());
+        if (!d)
+            return;
+        struct dirent* ent;
+        while ((ent = readdir(d)) != NULL) {
+            std::string name = ent->d_name;
+            size_t dot       = name.find_last_of('.');
+            size_t dash      = name.find_last_of('-', dot);
+            if (dot == std::string::npos || dash == std::string::npos || dot == dash + 1)
+                continue;
+            unsigned int n = 0;
+            size_t i;
+            for (i = dash + 1; i < dot && name[i] >= '0' && name[i] <= '9'; i++)
+                n = n * 10 + (name[i] - '0');
+            if (i != dot)
+                continue;
+            unsigned int& next = suffixes[dir + "/" + name.substr(0, dash + 1) + "|" + name.substr(dot)];
+            if (n + 1 > next)
+                next = n + 1;
+        }
+        closedir(d);
+    }
+
+    std::mutex lock;
+    std::unordered_map<std::string, bool> scanned;
+    std::unordered_map<std::string, unsigned int> suffixes;
+};
+
+static OutputIndex output_index;
+
+static std::string allocate_output_path(const SDParams& params) {
+    std::stringstream outPrefixStr;
+    outPrefixStr << params.seed << "-";
+    for (unsigned int i = 0; i < params.prompt.size() && i < 32; i++) {
+        char c = params.prompt[i];
+        if ((c >= 'A' && c <= 'Z') ||
+            (c >= 'a' && c <= 'z') ||
+            (c >= '0' && c <= '9')) {
+            outPrefixStr << c;
+        } else if (c == ' ') {
+            outPrefixStr << '_';
+        }
+    }
+    outPrefixStr << '-';
+    // Claimed now, since the image is written in the background
+    return output_index.claim("output", outPrefixStr.str(), image_format_ext(parse_image_format(params.output_format)));
+}
+
+// What an operation did, for reporting
+struct OpReport {
+    std::vector<std::string> outputs;
+    double load_time     = 0;
+    double generate_time = 0;
+    double upscale_time  = 0;
+};
+
+/* Apply a job's settings on top of the current parameters. Keys are named
+ * after the long command line options, with underscores. */
+static void apply_job(SDParams& params, const nlohmann::json& job) {
+    for (auto& item : job.items()) {
+        const std::string& key       = item.key();
+        const nlohmann::json& value = item.value();
+        if (key == "id" || key == "priority") {
+            // Handled by the scheduler
+        } else if (key == "prompt") {
+            params.prompt = value.get<std::string>();
+        } else if (key == "negative_prompt") {
+            params.negative_prompt = value.get<std::string>();
+        } else if (key == "seed") {
+            params.seed = value.get<int64_t>();
+        } else if (key == "width") {
+            params.width = value.get<int>();
+        } else if (key == "height") {
+            params.height = value.get<int>();
+        } else if (key == "steps") {
+            params.sample_steps = value.get<int>();
+        } else if (key == "batch_count") {
+            params.batch_count = value.get<int>();
+        } else if (key == "cfg_scale") {
+            params.cfg_scale = value.get<float>();
+        } else if (key == "guidance") {
+            params.guidance = value.get<float>();
+        } else if (key == "strength") {
+            params.strength = value.get<float>();
+        } else if (key == "control_strength") {
+            params.control_strength = value.get<float>();
+        } else if (key == "style_ratio") {
+            params.style_ratio = value.get<float>();
+        } else if (key == "slg_scale") {
+            params.slg_scale = value.get<float>();
+        } else if (key == "clip_skip") {
+            params.clip_skip = value.get<int>();
+        } else if (key == "sampling_method") {
+            int found = find_str(sample_method_str, N_SAMPLE_METHODS, value.get<std::string>());
+            if (found < 0)
+                throw std::invalid_argument("invalid sampling method " + value.get<std::string>());
+            params.sample_method = (sample_method_t)found;
+        } else if (key == "schedule") {
+            int found = find_str(schedule_str, N_SCHEDULES, value.get<std::string>());
+            if (found < 0)
+                throw std::invalid_argument("invalid schedule " + value.get<std::string>());
+            params.schedule = (schedule_t)found;
+        } else if (key == "resize_filter") {
+            int found = find_str(resize_filter_str, N_RESIZE_FILTERS, value.get<std::string>());
+            if (found < 0)
+                throw std::invalid_argument("invalid resize filter " + value.get<std::string>());
+            params.resize_filter = (ResizeFilter)found;
+        } else if (key == "resize_fit") {
+            int found = find_str(resize_fit_str, N_RESIZE_FITS, value.get<std::string>());
+            if (found < 0)
+                throw std::invalid_argument("invalid resize fit " + value.get<std::string>());
+            params.resize_fit = (ResizeFit)found;
+        } else if (key == "mode") {
+            int found = find_str(modes_str, MODE_COUNT, value.get<std::string>());
+            if (found < 0)
+                throw std::invalid_argument("invalid mode " + value.get<std::string>());
+            params.mode = (SDMode)found;
+        } else if (key == "init_img") {
+            params.input_path = value.get<std::string>();
+        } else if (key == "mask") {
+            params.mask_path = value.get<std::string>();
+        } else if (key == "control_image") {
+            params.control_image_path = value.get<std::string>();
+        } else if (key == "canny") {
+            params.canny_preprocess = value.get<bool>();
+        } else if (key == "output") {
+            params.output_path = value.get<std::string>();
+        } else if (key == "output_format") {
+            parse_image_format(value.get<std::string>());
+            params.output_format = value.get<std::string>();
+        } else if (key == "model") {
+            params.model_path = value.get<std::string>();
+        } else if (key == "diffusion_model") {
+            params.diffusion_model_path = value.get<std::string>();
+        } else if (key == "clip_l") {
+            params.clip_l_path = value.get<std::string>();
+        } else if (key == "clip_g") {
+            params.clip_g_path = value.get<std::string>();
+        } else if (key == "t5xxl") {
+            params.t5xxl_path = value.get<std::string>();
+        } else if (key == "vae") {
+            params.vae_path = value.get<std::string>();
+        } else if (key == "control_net") {
+            params.controlnet_path = value.get<std::string>();
+        } else if (key == "lora_model_dir") {
+            params.lora_model_dir = value.get<std::string>();
+        } else if (key == "upscale_model") {
+            params.esrgan_path = value.get<std::string>();
+        } else if (key == "upscale_repeats") {
+            params.upscale_repeats = value.get<int>();
+        } else if (key == "upscale_tile") {
+            params.upscale_tile = value.get<int>();
+        } else if (key == "upscale_workers") {
+            params.upscale_workers = value.get<int>();
+        } else if (key == "upscale_memory") {
+            params.upscale_memory = value.get<int>();
+        } else {
+            throw std::invalid_argument("unknown job key " + key);
+        }
+    }
+}
+
+/* A job from a job file, waiting to run or in progress. Its result line is
+ * written once it has been generated and all of its images have been
+ * written. */
+struct Job {
+    uint64_t seq = 0;  // arrival order
+    int priority = 0;
+    int skipped  = 0;  // times a later job has been run first
+    nlohmann::json id;
+    SDParams params;
+    SDParams ctx_params;
+    bool auto_output = false;
+    std::chrono::steady_clock::time_point queued;
+    std::function<void(const nlohmann::json&)> emit;
+    std::function<void(const nlohmann::json&)> progress;  // optional
+};
+
+// The settings of a job, on top of params. Throws if they're invalid.
+static Job parse_job(const SDParams& params, const nlohmann::json& json, const nlohmann::json& id) {
+    if (!json.is_object())
+        throw std::invalid_argument("job must be a JSON object");
+    Job job;
+    job.id     = id;
+    job.params = params;
+    apply_job(job.params, json);
+    if (json.contains("priority"))
+        job.priority = json["priority"].get<int>();
+    if (job.params.seed < 0)
+        job.params.seed = rand();
+    job.auto_output = !json.contains("output");
+    job.ctx_params  = sd_ctx_params(job.params);
+    return job;
+}
+
+struct JobState {
+    std::mutex lock;
+    nlohmann::json result;
+    int written = 0;
+    int pending = -1;  // images still being written, -1 while generating
+    std::chrono::steady_clock::time_point start;
+    std::function<void(const nlohmann::json&)> emit;
+
+    // Called with the lock held
+    void maybe_emit() {
+        if (pending != 0)
+            return;
+        result["timings"]["total"] = seconds_since(start);
+        event_log.emit("job_done", result);
+        emit(result);
+    }
+};
+
+static double rss_mb() {
+    long pages = 0, resident = 0;
+    FILE* statm = fopen("/proc/self/statm", "r");
+    if (statm) {
+        if (fscanf(statm, "%ld %ld", &pages, &resident) != 2)
+            resident = 0;
+        fclose(statm);
+    }
+    return resident * (double)sysconf(_SC_PAGESIZE) / 1048576.0;
+}
+
+/* Start the peak RSS over again from the current RSS, so that it covers only
+ * what follows. False if the kernel can't (before Linux 4.0), leaving it the
+ * process's peak so far. */
+static bool reset_peak_rss() {
+    int fd = open("/proc/self/clear_refs", O_WRONLY);
+    if (fd < 0)
+        return false;
+    bool ok = write(fd, "5", 1) == 1;
+    close(fd);
+    return ok;
+}
+
+// The peak RSS since the last reset_peak_rss, or since the process started
+static double peak_rss_mb() {
+    double peak  = 0;
+    FILE* status = fopen("/proc/self/status", "r");
+    if (status) {
+        char line[256];
+        long kb;
+        while (fgets(line, sizeof(line), status)) {
+            if (sscanf(line, "VmHWM: %ld kB", &kb) == 1)
+                peak = kb / 1024.0;
+        }
+        fclose(status);
+    }
+    return peak;
+}
+
+static void emit_resource_usage() {
+    if (!event_log.active())
+        return;
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    event_log.emit("resources", {{"rss_mb", rss_mb()},
+                                 {"peak_rss_mb", usage.ru_maxrss / 1024.0},
+                                 {"user_seconds", usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6},
+                                 {"system_seconds", usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6},
+                                 {"model_contexts", sd_ctx_pool.size()},
+                                 {"model_contexts_mb", sd_ctx_pool_size() / 1048576.0},
+                                 {"pixel_buffers_mb", buffer_pool.in_use_size() / 1048576.0}});
+}
+
+static void job_progress_cb(int step, int steps, float time, void* data) {
+    Job* job = (Job*)data;
+    job->progress({{"id", job->id}, {"event", "progress"}, {"step", step}, {"steps", steps}, {"time", time}});
+}
+
+/* Text conditioning isn't cached between jobs: the pinned
+ * stable-diffusion.cpp encodes the prompts inside txt2img and img2img and
+ * has no way to take precomputed conditioning, so every job encodes them
+ * again. */
+static void run_job(Job& job) {
+    auto state    = std::make_shared<JobState>();
+    state->start  = std::chrono::steady_clock::now();
+    state->emit   = job.emit;
+    state->result = {{"id", job.id}, {"status", "ok"}, {"outputs", nlohmann::json::array()}};
+    event_log.emit("job_started", {{"id", job.id}, {"seq", job.seq}});
+
+    std::string allocated;
+    int ret = 1;
+    OpReport report;
+    try {
+        if (job.auto_output && job.params.mode != CONVERT)
+            job.params.output_path = allocated = allocate_output_path(job.params);
+        if (job.progress)
+            set_progress_callback(job_progress_cb, &job);
+        ret = perform_op(job.params, [state](const std::string& path, bool ok) {
+            std::lock_guard<std::mutex> guard(state->lock);
+            if (ok) {
+                state->result["outputs"].push_back(path);
+            } else {
+                state->result["status"] = "error";
+                state->result["error"]  = "failed to write " + path;
+            }
+            state->written++;
+            if (state->pending > 0) {
+                state->pending--;
+                state->maybe_emit();
+            }
+        }, &report);
+        set_progress_callback(NULL, NULL);
+    } catch (const std::exception& e) {
+        set_progress_callback(NULL, NULL);
+        std::lock_guard<std::mutex> guard(state->lock);
+        state->result["status"] = "error";
+        state->result["error"]  = e.what();
+    }
+
+    if (ret != 0 && allocated.size())
+        unlink(allocated.c_str());
+    {
+        std::lock_guard<std::mutex> guard(state->lock);
+        state->result["seed"]                 = job.params.seed;
+        state->result["timings"]["queued"]    = std::chrono::duration<double>(state->start - job.queued).count();
+        state->result["timings"]["load"]      = report.load_time;
+        state->result["timings"]["generate"]  = report.generate_time;
+        state->result["timings"]["upscale"]   = report.upscale_time;
+        if (ret != 0 && state->result["status"] == "ok") {
+            state->result["status"] = "error";
+            state->result["error"]  = "generation failed";
+        }
+        // Some images may already have been written
+        state->pending = ret == 0 ? report.outputs.size() - state->written : 0;
+        state->maybe_emit();
+    }
+    emit_resource_usage();
+}
+
+/* Queue of jobs waiting to run. Rather than strictly in arrival order, the
+ * next job is the highest priority one that can reuse the current context,
+ * then the current resolution, sampler and batch size, so that mixed queues
+ * don't keep switching models. A job is passed over at most max_skip times
+ * before it runs regardless. Only the oldest max_window jobs are considered,
+ * so that each pick costs the same however long the queue: a job further
+ * back, whatever its priority, waits until it's among them. */
+class JobScheduler {
+public:
+    int max_skip   = 8;
+    int max_window = 256;
+
+    // Queue a job, returning its number
+    uint64_t push(Job job) {
+        std::lock_guard<std::mutex> guard(lock);
+        job.seq    = next_seq++;
+        job.queued = std::chrono::steady_clock::now();
+        if (job.id.is_null())
+            job.id = job.seq;
+        uint64_t seq = job.seq;
+        event_log.emit("job_queued", {{"id", job.id}, {"seq", seq}, {"priority", job.priority}});
+        jobs.push_back(std::move(job));
+        cond.notify_all();
+        return seq;
+    }
+
+    // Remove a job that hasn't started yet
+    bool cancel(uint64_t seq) {
+        std::lock_guard<std::mutex> guard(lock);
+        for (auto it = jobs.begin(); it != jobs.end(); it++) {
+            if (it->seq == seq) {
+                event_log.emit("job_cancelled", {{"id", it->id}, {"seq", seq}});
+                jobs.erase(it);
+                cond.notify_all();
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // The job from this worker's last pop has finished
+    void done() {
+        std::lock_guard<std::mutex> guard(lock);
+        workers[worker_id].running = false;
+        cond.notify_all();
+    }
+
+    // Wait until nothing is queued or running
+    void wait_idle() {
+        std::unique_lock<std::mutex> guard(lock);
+        cond.wait(guard, [this] { return jobs.size() == 0 && running_count() == 0; });
+    }
+
+    void print_queue() {
+        std::lock_guard<std::mutex> guard(lock);
+        for (auto& worker : workers) {
+            if (worker.second.running)
+                printf("%s (running)\n", describe(worker.second.current).c_str());
+        }
+        std::vector<const Job*> queued;
+        for (auto& job : jobs)
+            queued.push_back(&job);
+        std::sort(queued.begin(), queued.end(), [](const Job* a, const Job* b) { return a->seq < b->seq; });
+        for (auto job : queued)
+            printf("%s\n", describe(*job).c_str());
+        if (running_count() == 0 && queued.size() == 0)
+            printf("queue is empty\n");
+    }
+
+    // No more jobs are coming
+    void close() {
+        std::lock_guard<std::mutex> guard(lock);
+        closed = true;
+        cond.notify_all();
+    }
+
+    // Wait for the next job for this worker to run. False once closed and empty.
+    bool pop(Job& job) {
+        std::unique_lock<std::mutex> guard(lock);
+        cond.wait(guard, [this] { return jobs.size() > 0 || closed; });
+        if (jobs.size() == 0)
+            return false;
+
+        // Queued in arrival order, so the jobs passed over are those before it
+        auto next = pick();
+        for (auto it = jobs.begin(); it != next; it++)
+            it->skipped++;
+        job = std::move(*next);
+        jobs.erase(next);
+
+        WorkerState& self   = workers[worker_id];
+        self.running        = true;
+        self.current.seq    = job.seq;
+        self.current.params = job.params;
+        ran++;
+        self.have_last = true;
+        self.last      = job.params;
+        self.last_ctx  = job.ctx_params;
+        return true;
+    }
+
+    void print_stats() {
+        std::lock_guard<std::mutex> guard(lock);
+        printf("scheduler: %llu jobs, %llu model switches (%llu avoided), %llu resolution/sampler changes avoided\n",
+               (unsigned long long)ran,
+               (unsigned long long)model_switches,
+               (unsigned long long)model_switches_avoided,
+               (unsigned long long)graph_changes_avoided);
+    }
+
+private:
+    static std::string describe(const Job& job) {
+        char buf[64];
+        snprintf(buf, sizeof(buf), "%llu: %dx%d, %d steps, seed %lld: ",
+                 (unsigned long long)job.seq, job.params.width, job.params.height,
+                 job.params.sample_steps, (long long)job.params.seed);
+        return buf + job.params.prompt.substr(0, 48);
+    }
+
+    size_t running_count() {
+        size_t count = 0;
+        for (auto& worker : workers)
+            count += worker.second.running;
+        return count;
+    }
+
+    // 0 reuses this worker's current context, 1 one in its pool, 2 needs loading
+    int model_cost(const Job& job) {
+        WorkerState& self = workers[worker_id];
+        if (self.have_last && diff_params(self.last_ctx, job.ctx_params).size() == 0)
+            return 0;
+        std::lock_guard<std::mutex> guard(sd_ctx_pool_lock);
+        for (auto& entry : sd_ctx_pool) {
+            if (entry.worker == worker_id && diff_params(entry.params, job.ctx_params).size() == 0)
+                return 1;
+        }
+        return 2;
+    }
+
+    bool same_graph(const Job& job) {
+        WorkerState& self = workers[worker_id];
+        return self.have_last &&
+               job.params.width == self.last.width &&
+               job.params.height == self.last.height &&
+               job.params.sample_method == self.last.sample_method &&
+               job.params.batch_count == self.last.batch_count;
+    }
+
+    std::list<Job>::iterator pick() {
+        auto oldest = jobs.begin();
+        auto end    = jobs.begin();
+        for (int n = 0; n < max_window && end != jobs.end(); n++)
+            end++;
+
+        // Anything that has waited long enough goes first
+        auto best = end;
+        for (auto it = jobs.begin(); it != end; it++) {
+            if (it->skipped >= max_skip) {
+                best = it;
+                break;
+            }
+        }
+
+        if (best == end) {
+            int best_cost = 0;
+            for (auto it = jobs.begin(); it != end; it++) {
+                // Lower is better: priority, then model, then graph, then age
+                int cost = model_cost(*it) * 2 + (same_graph(*it) ? 0 : 1);
+                if (best == end ||
+                    it->priority > best->priority ||
+                    (it->priority == best->priority && cost < best_cost)) {
+                    best      = it;
+                    best_cost = cost;
+                }
+            }
+        }
+
+        int cost = model_cost(*best);
+        if (cost > 0)
+            model_switches++;
+        if (best != oldest) {
+            if (cost == 0 && model_cost(*oldest) > 0)
+                model_switches_avoided++;
+            if (same_graph(*best) && !same_graph(*oldest))
+                graph_changes_avoided++;
+        }
+        return best;
+    }
+
+    // What each worker (just one, without --numa-workers) is running and last ran
+    struct WorkerState {
+        bool running = false;
+        Job current;
+        bool have_last = false;
+        SDParams last, last_ctx;
+    };
+
+    std::mutex lock;
+    std::condition_variable cond;
+    std::list<Job> jobs;
+    std::map<int, WorkerState> workers;
+    uint64_t next_seq = 1;
+    bool closed       = false;
+
+    uint64_t ran                    = 0;
+    uint64_t model_switches         = 0;
+    uint64_t model_switches_avoided = 0;
+    uint64_t graph_changes_avoided  = 0;
+};
+
+/* --numa-workers runs a worker per NUMA node rather than one for the whole
+ * machine, so that on multi-socket hosts each context's threads and memory
+ * stay on one node instead of sharing one context across the interconnect.
+ * Each worker has its own contexts, its threads pinned to its node's CPUs
+ * and its memory bound to the node (which the threads ggml starts from it
+ * inherit), and pulls jobs from the same scheduler as the others, preferring
+ * those it already has the model for. */
+struct NumaNode {
+    int id;
+    std::vector<int> cpus;
+    int cores = 0;  // physical ones, counting each CPU's SMT siblings once
+};
+
+// The NUMA nodes with CPUs, from sysfs; empty if there's no NUMA information
+static std::vector<NumaNode> numa_nodes() {
+    std::vector<NumaNode> nodes;
+    for (int id : parse_cpu_list(read_line("/sys/devices/system/node/online"))) {
+        NumaNode node;
+        node.id   = id;
+        node.cpus = parse_cpu_list(read_line("/sys/devices/system/node/node" + std::to_string(id) + "/cpulist"));
+        for (int cpu : node.cpus) {
+            std::vector<int> siblings = parse_cpu_list(
+                read_line("/sys/devices/system/cpu/cpu" + std::to_string(cpu) + "/topology/thread_siblings_list"));
+            if (siblings.size() == 0 || siblings[0] == cpu)
+                node.cores++;
+        }
+        if (node.cpus.size() > 0)
+            nodes.push_back(node);
+    }
+    return nodes;
+}
+
+// Pin the calling thread to a node's CPUs, and its allocations to its memory
+static bool bind_to_node(const NumaNode& node) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu : node.cpus)
+        CPU_SET(cpu, &set);
+    if (sched_setaffinity(0, sizeof(set), &set) != 0)
+        return false;
+
+    const int mpol_bind = 2;  // MPOL_BIND, without needing libnuma's headers
+    std::vector<unsigned long> mask(node.id / (8 * sizeof(unsigned long)) + 1, 0);
+    mask[node.id / (8 * sizeof(unsigned long))] |= 1UL << (node.id % (8 * sizeof(unsigned long)));
+    return syscall(SYS_set_mempolicy, mpol_bind, mask.data(), mask.size() * 8 * sizeof(unsigned long) + 1) == 0;
+}
+
+// Run jobs until the scheduler is closed and empty, on one worker per node with --numa-workers
+static void run_workers(JobScheduler& scheduler, const SDParams& params) {
+    auto work = [&scheduler] {
+        Job job;
+        while (scheduler.pop(job)) {
+            run_job(job);
+            scheduler.done();
+        }
+    };
+
+    std::vector<NumaNode> nodes;
+    if (params.numa_workers) {
+        nodes = numa_nodes();
+        if (nodes.size() < 2)
+            printf("only one NUMA node, so running a single worker\n");
+    }
+    if (nodes.size() < 2) {
+        work();
+        return;
+    }
+
+    // Shared by every worker, so set up before any of them starts
+    image_writer.configure(params.writer_threads, params.writer_queue);
+    progress_per_thread = true;
+    sd_set_progress_callback(events_progress_cb, NULL);
+
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < nodes.size(); i++) {
+        threads.emplace_back([&, i] {
+            const NumaNode& node = nodes[i];
+            worker_id            = i;
+            worker_threads       = node.cores;
+            if (!bind_to_node(node))
+                fprintf(stderr, "worker %d: failed to bind to node %d: %s\n", (int)i, node.id, strerror(errno));
+            printf("worker %d: node %d, %zu CPUs, up to %d threads\n", (int)i, node.id, node.cpus.size(), node.cores);
+            work();
+        });
+    }
+    for (auto& thread : threads)
+        thread.join();
+
+    // Back to a single callback for the process
+    progress_per_thread = false;
+    set_progress_callback(progress_cb, progress_cb_data);
+}
+
+/* Parse one line of a job file or socket and queue it, or report why it
+ * couldn't be. */
+static void queue_job_line(JobScheduler& scheduler,
+                           const SDParams& params,
+                           const std::string& line,
+                           int line_no,
+                           std::function<void(const nlohmann::json&)> emit,
+                           std::function<void(const nlohmann::json&)> progress = nullptr) {
+    nlohmann::json json = nlohmann::json::parse(line, nullptr, false);
+    nlohmann::json id   = json.is_object() && json.contains("id") ? json["id"] : nlohmann::json(line_no);
+    try {
+        if (json.is_discarded())
+            throw std::invalid_argument("invalid JSON");
+        Job job      = parse_job(params, json, id);
+        job.emit     = emit;
+        job.progress = progress;
+        scheduler.push(std::move(job));
+        if (progress)
+            progress({{"id", id}, {"event", "queued"}});
+    } catch (const std::exception& e) {
+        emit({{"id", id}, {"status", "error"}, {"error", e.what()}});
+    }
+}
+
+/* Run every job in a JSONL file ("-" for stdin), writing one result line per
+ * job. Jobs are read on another thread, so the scheduler can choose among
+ * everything that has arrived. */
+static int run_jobs(const SDParams& params, const std::string& path, FILE* results) {
+    std::ifstream file;
+    std::istream* in = &std::cin;
+    if (path != "-") {
+        file.open(path);
+        if (!file) {
+            fprintf(stderr, "error: failed to open job file %s\n", path.c_str());
+            return 1;
+        }
+        in = &file;
+    }
+
+    auto results_lock = std::make_shared<std::mutex>();
+    auto emit         = [results, results_lock](const nlohmann::json& result) {
+        std::lock_guard<std::mutex> guard(*results_lock);
+        fprintf(results, "%s\n", result.dump().c_str());
+        fflush(results);
+    };
+
+    JobScheduler scheduler;
+    scheduler.max_skip = params.job_reorder;
+    std::thread reader([&] {
+        std::string line;
+        int line_no = 0;
+        while (std::getline(*in, line)) {
+            line_no++;
+            if (line.find_first_not_of(" \t\r") == std::string::npos)
+                continue;
+            queue_job_line(scheduler, params, line, line_no, emit);
+        }
+        scheduler.close();
+    });
+
+    run_workers(scheduler, params);
+    reader.join();
+
+    image_writer.wait();
+    scheduler.print_stats();
+    buffer_pool.print_stats();
+    return 0;
+}
+
+/* A client of the job socket. Results and progress go back to the client
+ * that submitted the job, for as long as it stays connected. Lines are queued
+ * and written by the client's own thread, so a client that stops reading
+ * never holds up generation or other clients; one that falls too far behind
+ * is disconnected. */
+struct SocketClient : std::enable_shared_from_this<SocketClient> {
+    static const size_t max_queued = 1024;  // lines
+    int fd;
+    std::mutex lock;
+    std::condition_variable cond;
+    std::deque<std::string> queue;
+    bool open = true;
+
+    ~SocketClient() {
+        close(fd);
+    }
+
+    void start() {
+        auto self = shared_from_this();
+        std::thread([self] {
+            self->drain();
+        }).detach();
+    }
+
+    void send(const nlohmann::json& message) {
+        std::string line = message.dump() + "\n";
+        std::lock_guard<std::mutex> guard(lock);
+        if (!open)
+            return;
+        if (queue.size() >= max_queued) {
+            fprintf(stderr, "a client isn't reading its results, disconnecting it\n");
+            disconnect();
+            return;
+        }
+        queue.push_back(std::move(line));
+        cond.notify_one();
+    }
+
+    // With lock held. Wakes the reader too, if it's still reading.
+    void disconnect() {
+        open = false;
+        queue.clear();
+        shutdown(fd, SHUT_RDWR);
+        cond.notify_one();
+    }
+
+private:
+    void drain() {
+        std::unique_lock<std::mutex> guard(lock);
+        while (true) {
+            cond.wait(guard, [this] { return queue.size() > 0 || !open; });
+            if (!open)
+                return;
+            std::string line = std::move(queue.front());
+            queue.pop_front();
+            guard.unlock();
+            size_t off = 0;
+            while (off < line.size()) {
+                ssize_t ret = ::send(fd, line.data() + off, line.size() - off, MSG_NOSIGNAL);
+                if (ret < 0 && errno == EINTR)
+                    continue;
+                if (ret <= 0)
+                    break;
+                off += ret;
+            }
+            guard.lock();
+            if (off < line.size() && open)
+                disconnect();
+        }
+    }
+};
+
+static void serve_client(std::shared_ptr<SocketClient> client, JobScheduler& scheduler, const SDParams& params) {
+    auto emit = [client](const nlohmann::json& result) {
+        nlohmann::json message = result;
+        message["event"]       = "done";
+        client->send(message);
+    };
+    auto progress = [client](const nlohmann::json& message) {
+        client->send(message);
+    };
+
+    std::string buf, line;
+    char chunk[4096];
+    int line_no = 0;
+    while (true) {
+        ssize_t ret = read(client->fd, chunk, sizeof(chunk));
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            break;
+        buf.append(chunk, ret);
+        size_t nl;
+        while ((nl = buf.find('\n')) != std::string::npos) {
+            line = buf.substr(0, nl);
+            buf.erase(0, nl + 1);
+            line_no++;
+            if (line.find_first_not_of(" \t\r") == std::string::npos)
+                continue;
+            queue_job_line(scheduler, params, line, line_no, emit, progress);
+        }
+    }
+
+    /* Jobs still queued keep a reference and are run regardless; their
+     * results are dropped. */
+    std::lock_guard<std::mutex> guard(client->lock);
+    client->disconnect();
+}
+
+/* Serve jobs from a Unix socket: each client sends JSONL jobs, as in a job
+ * file, and gets back a line when each is queued, as it progresses, and when
+ * it's done. All clients share the same scheduler and loaded models. */
+static int serve(const SDParams& params, const std::string& path) {
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        perror("socket");
+        return 1;
+    }
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "error: socket path %s is too long\n", path.c_str());
+        close(fd);
+        return 1;
+    }
+    strcpy(addr.sun_path, path.c_str());
+
+    // Replace a socket left behind by a server that's gone, but nothing else
+    struct stat st;
+    if (lstat(path.c_str(), &st) == 0) {
+        if (!S_ISSOCK(st.st_mode)) {
+            fprintf(stderr, "error: %s exists and isn't a socket\n", path.c_str());
+            close(fd);
+            return 1;
+        }
+        int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+        bool live = probe >= 0 && connect(probe, (struct sockaddr*)&addr, sizeof(addr)) == 0;
+        if (probe >= 0)
+            close(probe);
+        if (live) {
+            fprintf(stderr, "error: another server is listening on %s\n", path.c_str());
+            close(fd);
+            return 1;
+        }
+        unlink(path.c_str());
+    }
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(fd, 16) < 0) {
+        perror(path.c_str());
+        close(fd);
+        return 1;
+    }
+    printf("listening on %s\n", path.c_str());
+    fflush(stdout);
+
+    JobScheduler scheduler;
+    scheduler.max_skip = params.job_reorder;
+    std::thread acceptor([&] {
+        while (true) {
+            int cfd = accept(fd, NULL, NULL);
+            if (cfd < 0) {
+                if (errno == EINTR || errno == ECONNABORTED)
+                    continue;
+                perror("accept");
+                break;
+            }
+            auto client = std::make_shared<SocketClient>();
+            client->fd  = cfd;
+            client->start();
+            std::thread(serve_client, client, std::ref(scheduler), std::cref(params)).detach();
+        }
+        scheduler.close();
+    });
+
+    run_workers(scheduler, params);
+    acceptor.join();
+    close(fd);
+    unlink(path.c_str());
+    return 0;
+}
+
+/* --bench runs every combination of the --bench-matrix settings (keys as in
+ * a job file, plus "size" as WxH, each with comma-separated values), each a
+ * few times to warm up and then a given number of times for measurement,
+ * always with the same seed. The library doesn't time its own stages for
+ * callers, so text encoding, sampling and VAE decoding are taken from the
+ * timings it logs, and per-step times from the progress callback. */
+struct BenchTimings {
+    double text_encode = 0;
+    double sampling    = 0;
+    double vae_decode  = 0;
+    std::vector<float> steps;
+};
+
+// Pick stage timings out of a library log line, for --bench and --events
+static void note_stage_log(const char* log) {
+    static const struct {
+        const char* text;
+        const char* event;
+        double BenchTimings::*field;
+        double scale;
+    } stages[] = {
+        {"get_learned_condition completed, taking ", "text_encode", &BenchTimings::text_encode, 0.001},
+        {"sampling completed, taking ", "sampling", &BenchTimings::sampling, 1},
+        {"decode_first_stage completed, taking ", "decode", &BenchTimings::vae_decode, 1},
+    };
+    for (auto& stage : stages) {
+        const char* found = strstr(log, stage.text);
+        if (!found)
+            continue;
+        double seconds = atof(found + strlen(stage.text)) * stage.scale;
+        if (bench_timings)
+            bench_timings->*stage.field += seconds;
+        event_log.emit(stage.event, {{"seconds", seconds}});
+    }
+}
+
+static void bench_progress_cb(int step, int steps, float time, void* data) {
+    BenchTimings* timings = (BenchTimings*)data;
+    if (time > 0)
+        timings->steps.push_back(time);
+}
+
+/* A matrix value as the JSON its key takes: a number or boolean if it reads
+ * as one and the key accepts that, otherwise a string */
+static nlohmann::json bench_value(const std::string& key, const std::string& value) {
+    std::vector<nlohmann::json> candidates;
+    nlohmann::json parsed = nlohmann::json::parse(value, nullptr, false);
+    if (parsed.is_number() || parsed.is_boolean())
+        candidates.push_back(parsed);
+    candidates.push_back(value);
+    std::string error;
+    for (auto& candidate : candidates) {
+        try {
+            SDParams scratch;
+            apply_job(scratch, {{key, candidate}});
+            return candidate;
+        } catch (const std::exception& e) {
+            error = e.what();
+        }
+    }
+    throw std::invalid_argument("invalid bench value " + key + "=" + value + ": " + error);
+}
+
+// Every combination of the matrix's values, as job objects
+static std::vector<nlohmann::json> bench_configs(const std::string& matrix) {
+    std::vector<std::pair<std::string, std::vector<nlohmann::json>>> axes;
+    std::stringstream axes_str(matrix);
+    std::string axis;
+    while (std::getline(axes_str, axis, ';')) {
+        size_t eq = axis.find('=');
+        if (axis == "")
+            continue;
+        if (eq == std::string::npos)
+            throw std::invalid_argument("invalid bench matrix entry " + axis);
+        std::string key = axis.substr(0, eq);
+        std::vector<nlohmann::json> values;
+        std::stringstream values_str(axis.substr(eq + 1));
+        std::string value;
+        while (std::getline(values_str, value, ',')) {
+            if (key == "size") {
+                int width, height;
+                char end;
+                if (sscanf(value.c_str(), "%dx%d%c", &width, &height, &end) != 2)
+                    throw std::invalid_argument("invalid bench size " + value);
+                values.push_back({{"width", width}, {"height", height}});
+            } else {
+                values.push_back({{key, bench_value(key, value)}});
+            }
+        }
+        axes.push_back(std::make_pair(key, values));
+    }
+
+    std::vector<nlohmann::json> configs = {nlohmann::json::object()};
+    for (auto& axis : axes) {
+        std::vector<nlohmann::json> next;
+        for (auto& config : configs) {
+            for (auto& value : axis.second) {
+                nlohmann::json combined = config;
+                combined.update(value);
+                next.push_back(combined);
+            }
+        }
+        configs = next;
+    }
+    return configs;
+}
+
+static int run_bench(const SDParams& params, int runs, int warmup, const std::string& matrix, FILE* results) {
+    std::vector<nlohmann::json> configs;
+    try {
+        configs = bench_configs(matrix);
+    } catch (const std::exception& e) {
+        fprintf(stderr, "error: %s\n", e.what());
+        return 1;
+    }
+
+    nlohmann::json report = nlohmann::json::array();
+    bool peak_per_config  = true;
+    for (auto& config : configs) {
+        peak_per_config = reset_peak_rss() && peak_per_config;
+        SDParams base   = params;
+        try {
+            apply_job(base, config);
+        } catch (const std::exception& e) {
+            fprintf(stderr, "error: %s\n", e.what());
+            return 1;
+        }
+        if (base.seed < 0)
+            base.seed = 42;
+
+        nlohmann::json result = {{"config", config},
+                                 {"width", base.width},
+                                 {"height", base.height},
+                                 {"sampling_method", sample_method_str[base.sample_method]},
+                                 {"schedule", schedule_str[base.schedule]},
+                                 {"steps", base.sample_steps},
+                                 {"batch_count", base.batch_count},
+                                 {"runs", nlohmann::json::array()}};
+        double total_time = 0;
+        int images        = 0;
+        for (int r = 0; r < warmup + runs; r++) {
+            SDParams run_params = base;
+            BenchTimings timings;
+            OpReport op;
+            bench_timings = &timings;
+            set_progress_callback(bench_progress_cb, &timings);
+            auto start = std::chrono::steady_clock::now();
+            int ret    = perform_op(run_params, nullptr, &op);
+            auto made  = std::chrono::steady_clock::now();
+            image_writer.wait();
+            double write = seconds_since(made);
+            double total = seconds_since(start);
+            set_progress_callback(NULL, NULL);
+            bench_timings = NULL;
+            emit_resource_usage();
+            if (ret != 0) {
+                fprintf(stderr, "error: bench run failed\n");
+                return 1;
+            }
+
+            double step = 0;
+            for (float t : timings.steps)
+                step += t;
+            if (timings.steps.size())
+                step /= timings.steps.size();
+            nlohmann::json run = {{"warmup", r < warmup},
+                                  {"load", op.load_time},
+                                  {"text_encode", timings.text_encode},
+                                  {"sampling", timings.sampling},
+                                  {"step", step},
+                                  {"vae_decode", timings.vae_decode},
+                                  {"generate", op.generate_time},
+                                  {"upscale", op.upscale_time},
+                                  {"write", write},
+                                  {"total", total},
+                                  {"images", op.outputs.size()}};
+            result["runs"].push_back(run);
+            if (r >= warmup) {
+                total_time += total;
+                images += op.outputs.size();
+            }
+        }
+
+        // Means over the measured runs
+        nlohmann::json mean = nlohmann::json::object();
+        for (const char* key : {"load", "text_encode", "sampling", "step", "vae_decode", "generate", "upscale", "write", "total"}) {
+            double sum = 0;
+            for (auto& run : result["runs"]) {
+                if (!run["warmup"].get<bool>())
+                    sum += run[key].get<double>();
+            }
+            mean[key] = runs > 0 ? sum / runs : 0;
+        }
+        result["mean"]           = mean;
+        result["cold_load"]      = result["runs"][0]["load"];
+        result["images_per_sec"] = total_time > 0 ? images / total_time : 0;
+        result["peak_rss_mb"]    = peak_rss_mb();
+        result["rss_mb"]         = rss_mb();
+        report.push_back(result);
+    }
+
+    if (!peak_per_config)
+        printf("\nnote: the kernel can't reset peak RSS, so each is the peak of the run so far\n");
+    printf("\n%-36s %7s %7s %7s %7s %7s %7s %7s %7s %8s\n",
+           "config", "load", "encode", "step", "sample", "decode", "upscale", "write", "img/s", "peak MB");
+    for (auto& result : report) {
+        char name[64];
+        snprintf(name, sizeof(name), "%dx%d %s/%s %d steps x%d",
+                 result["width"].get<int>(), result["height"].get<int>(),
+                 result["sampling_method"].get<std::string>().c_str(), result["schedule"].get<std::string>().c_str(),
+                 result["steps"].get<int>(), result["batch_count"].get<int>());
+        auto& mean = result["mean"];
+        printf("%-36s %6.2fs %6.2fs %6.3fs %6.2fs %6.2fs %6.2fs %6.2fs %7.3f %8.0f\n", name,
+               result["cold_load"].get<double>(), mean["text_encode"].get<double>(), mean["step"].get<double>(),
+               mean["sampling"].get<double>(), mean["vae_decode"].get<double>(), mean["upscale"].get<double>(),
+               mean["write"].get<double>(), result["images_per_sec"].get<double>(), result["peak_rss_mb"].get<double>());
+    }
+
+    if (results) {
+        fprintf(results, "%s\n", report.dump(2).c_str());
+        fflush(results);
+    }
+    return 0;
+}
+
+/* Time a few sampling steps at each of several thread counts, and record the
+ * fastest for this model and type in the tuning file. The first step of
+ * each run is left out, since it includes building the graph. */
+static int tune_threads(const SDParams& params) {
+    int cores = allowed_cores();
+    cpu_set_t set;
+    int cpus = sched_getaffinity(0, sizeof(set), &set) == 0 ? CPU_COUNT(&set) : cores;
+    std::set<int> candidates;
+    for (int n : {cores, cores * 3 / 4, cores / 2, cores - 1, cpus}) {
+        if (n >= 1)
+            candidates.insert(n);
+    }
+
+    SDParams base = params;
+    base.mode             = TXT2IMG;
+    base.sample_steps     = 4;
+    base.batch_count      = 1;
+    base.seed             = 42;
+    base.esrgan_path      = "";
+    base.output_format    = "png:0";
+    base.output_path      = "/tmp/sdinter-tune-" + std::to_string(getpid()) + ".png";
+    base.model_cache_size = 0;
+
+    std::string key = thread_tuning_key(params);
+    printf("tuning threads for %s at %dx%d\n", key.c_str(), params.width, params.height);
+    nlohmann::json results = nlohmann::json::object();
+    int best               = 0;
+    double best_time       = 0;
+    for (int n : candidates) {
+        SDParams run_params = base;
+        run_params.n_threads = n;
+        BenchTimings timings;
+        set_progress_callback(bench_progress_cb, &timings);
+        int ret = perform_op(run_params);
+        set_progress_callback(NULL, NULL);
+        image_writer.wait();
+        unlink(base.output_path.c_str());
+        if (ret != 0) {
+            fprintf(stderr, "error: tuning run failed\n");
+            return 1;
+        }
+
+        std::vector<float>& steps = timings.steps;
+        if (steps.size() > 1)
+            steps.erase(steps.begin());
+        if (steps.empty())
+            continue;
+        std::sort(steps.begin(), steps.end());
+        double step = steps[steps.size() / 2];
+        printf("%4d threads: %.3fs/step\n", n, step);
+        fflush(stdout);
+        results[std::to_string(n)] = step;
+        if (!best || step < best_time) {
+            best      = n;
+            best_time = step;
+        }
+    }
+    if (!best) {
+        fprintf(stderr, "error: no step times were reported\n");
+        return 1;
+    }
+
+    std::lock_guard<std::mutex> guard(thread_tuning_lock);
+    thread_tuning        = load_thread_tuning();
+    thread_tuning_loaded = true;
+    thread_tuning[key]   = {{"threads", best},
+                            {"step_seconds", best_time},
+                            {"width", params.width},
+                            {"height", params.height},
+                            {"candidates", results}};
+    size_t slash = thread_tuning_path.rfind('/');
+    if (slash != std::string::npos && slash > 0)
+        mkdir(thread_tuning_path.substr(0, slash).c_str(), 0755);
+    std::string tmp = thread_tuning_path + ".tmp";
+    FILE* out       = fopen(tmp.c_str(), "w");
+    if (!out) {
+        fprintf(stderr, "error: failed to open %s\n", tmp.c_str());
+        return 1;
+    }
+    fprintf(out, "%s\n", thread_tuning.dump(2).c_str());
+    fclose(out);
+    if (rename(tmp.c_str(), thread_tuning_path.c_str()) != 0) {
+        fprintf(stderr, "error: failed to write %s\n", thread_tuning_path.c_str());
+        return 1;
+    }
+    printf("best: %d threads (%.3fs/step), recorded in %s\n", best, best_time, thread_tuning_path.c_str());
+    return 0;
+}
+
+/* Restrict every thread, including those already started (the event and
+ * preview writers), to the CPUs in the list */
+static bool apply_cpuset(const std::string& list) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu : parse_cpu_list(list)) {
+        if (cpu >= 0 && cpu < CPU_SETSIZE)
+            CPU_SET(cpu, &set);
+    }
+    if (CPU_COUNT(&set) == 0) {
+        errno = EINVAL;
+        return false;
+    }
+    DIR* dir = opendir("/proc/self/task");
+    if (!dir)
+        return sched_setaffinity(0, sizeof(set), &set) == 0;
+    bool ok = true;
+    while (struct dirent* ent = readdir(dir)) {
+        if (ent->d_name[0] == '.')
+            continue;
+        if (sched_setaffinity(atoi(ent->d_name), sizeof(set), &set) != 0)
+            ok = false;
+    }
+    closedir(dir);
+    return ok;
+}
+
+/* Placement of the compute threads is left to the OpenMP runtime ggml uses,
+ * which reads these when it starts; anything already set in the environment
+ * wins. */
+static void apply_cpu_affinity(const std::string& mode) {
+    if (mode == "none")
+        return;
+    setenv("OMP_PLACES", "cores", 0);
+    setenv("OMP_PROC_BIND", mode == "compact" ? "close" : "spread", 0);
+}
+
+// sdbench.cpp includes this file for its internals, with its own main
+#ifndef SDINTER_NO_MAIN
+int main(int argc, const char* argv[]) {
+    SDParams params;
+
+    sd_set_log_callback(sd_log_cb, (void*)&params);
+
+    int64_t seed = -1;
+    srand((int)time(NULL));
+    if (getenv("HOME"))
+        thread_tuning_path = std::string(getenv("HOME")) + "/.cache/sdinter-threads.json";
+
+    bool invalid_arg = false, interactive = false, tune = false;
+    std::string cpuset, cpu_affinity = "none";
+    std::string jobs_path, job_results_path = "-", listen_path;
+    int bench_runs = 0, bench_warmup = 1;
+    std::string bench_matrix, bench_results_path = "-";
+    std::string arg;
+    for (int i = 1; i < argc; i++) {
+        arg = argv[i];
+
+        if (arg == "-t" || arg == "--threads") {
+            if (++i >= argc) {
+                invalid_arg = true;
+                break;
+            }
+            params.n_threads = std::stoi(argv[i]);
+        } else if (arg == "-M" || arg == "--mode") {
+            if (++i >= argc) {
+                invalid_arg = true;
+                break;
+            }
+            const char* mode_selected = argv[i];
+            int mode_found            = -1;
+            for (int d = 0; d < MODE_COUNT; d++) {
+                if (!strcmp(mode_selected, modes_str[d])) {
+                    mode_found = d;
+                }
+            }
+            if (mode_found == -1) {
+                fprintf(stderr,
+                        "error: invalid mode %s, must be one of [txt2img, img2img, img2vid, convert]\n",
+                        mode_selected);
+                exit(1);
+            }
+            params.mode = (SDMode)mode_found;
+        } else if (arg == "-m" || arg == "--model") {
+            if (++i >= argc) {
+                invalid_arg = true;
+                break;
+            }
+            params.model_path = argv[i];
+        } else if (arg == "--clip_l") {
+            if (++i >= argc) {
+                invalid_arg = true;
+                break;
+            }
+            params.clip_l_path = argv[i];
+        } else if (arg == "--clip_g") {
+            if (++i >= argc) {
+                invalid_arg = true;
+                break;
+            }
+            params.clip_g_path = argv[i];
+        } else if (arg == "--t5xxl") {
+            if (++i >= argc) {
+                invalid_arg = true;
+                break;
+            }
+            params.t5xxl_path = argv[i];
+        } else if (arg == "--diffusion-model") {
+            if (++i >= argc) {
+                invalid_arg = true;
+                break;
+            }
+            params.diffusion_model_path = argv[i];
+        } else if (arg == "--vae") {
+            if (++i >= argc) {
+                invalid_arg = true;
+                break;
+            }
+            params.vae_path = argv[i];
+        } else if (arg == "--taesd") {
+            if (++i >= argc) {
+                invalid_arg = true;
+                break;
+            }
+            params.taesd_path = argv[i];
+        } else if (arg == "--control-net") {
+            if (++i >= argc) {
+                invalid_arg = true;
+                break;
+            }
+            params.controlnet_path = argv[i];
+        } else if (arg == "--upscale-model") {
+            if (++i >= argc) {
+                invalid_arg = true;
+                break;
+            }
+            params.esrgan_path = argv[i];
+        } else if (arg == "--embd-dir") {
+            if (++i >= argc) {
+                invalid_arg = true;
+                break;
+            }
+            params.embeddings_path = argv[i];
+        } else if (arg == "--stacked-id-embd-dir") {
+            if (++i >= argc) {
+                invalid_arg = true;
+                break;
+            }
+            params.stacked_id_embeddings_path = argv[i];
+        } else if (arg == "--input-id-images-dir") {
+            if (++i >= argc) {
+                invalid_arg = true;
+                break;
+            }
+            params.input_id_images_path = argv[i];
+        } else if (arg == "--type") {
+            if (++i >= argc) {
+                invalid_arg = true;
+                break;
+            }
+            std::string type        = argv[i];
+            bool found              = false;
+            std::string valid_types = "";
+            for (size_t i = 0; i < SD_TYPE_COUNT; i++) {
+                auto trait = ggml_get_type_traits((ggml_type)i);
+                std::string name(trait->type_name);
+                if (name == "f32" || trait->to_float && trait->type_size) {
+                    if (i)
+                        valid_types += ", ";
+                    valid_types += name;
+                    if (type == name) {
+                        if (ggml_quantize_requires_imatrix((ggml_type)i)) {
+                            printf("\033[35;1m[WARNING]\033[0m: type %s requires imatrix to work properly. A dummy imatrix will be used, expect poor quality.\n", trait->type_name);
+                        }
+                        params.wtype = (enum sd_type_t)i;
+                        found        = true;
+                        break;
+                    }
+                }
+            }
+            if (!found) {
+                fprintf(stderr, "error: invalid weight format %s, must be one of [%s]\n",
+                        type.c_str(),
+                        valid_types.c_str());
+                exit(1);
+            }
+        } else if (arg == "--lora-model-dir") {
+            if (++i >= argc) {
+                invalid_arg = true;
+                break;
+            }
+            params.lora_model_dir = argv[i];
+        } else if (arg == "--model-cache-size") {
+            if (++i >= argc) {
+                invalid_arg = true;
+                break;
+            }
+            params.model_cache_size = std::stoi(argv[i]);
+        } else if (arg == "--convert-cache") {
+            if (++i >= argc) {
+                invalid_arg = true;
+                break;
+            }
+            params.convert_cache = argv[i];
+        } else if (arg == "--weights-shm") {
+            if (++i >= argc) {
+                invalid_arg = true;
+                break;
+            }
+            params.weights_shm = argv[i];
+        } else if (arg == "--image-cache-size") {
+            if (++i >= argc) {
+                invalid_arg = true;
+                break;
+            }
+            params.image_cache_size = std::stoi(argv[i]);
+        } else if (arg == "--resize-filter") {
+            if (++i >= argc) {
+                invalid_arg = true;
+                break;
+            }
+            int found = find_str(resize_filter_str, N_RESIZE_FILTERS, argv[i]);
+            if (found < 0) {
+                invalid_arg = true;
+                break;
+            }
+            params.resize_filter = (ResizeFilter)found;
+        } else if (arg == "--resize-fit") {
+            if (++i >= argc) {
+                invalid_arg = true;
+                break;
+            }
+            int found = find_str(resize_fit_str, N_RESIZE_FITS, argv[i]);
+            if (found < 0) {
                 invalid_arg = true;
                 break;
             }
-            params.vae_path = argv[i];
-        } else if (arg == "--taesd") {
+            params.resize_fit = (ResizeFit)found;
+        } else if (arg == "--writer-threads") {
             if (++i >= argc) {
                 invalid_arg = true;
                 break;
             }
-            params.taesd_path = argv[i];
-        } else if (arg == "--control-net") {
+            params.writer_threads = std::stoi(argv[i]);
+        } else if (arg == "--writer-queue") {
             if (++i >= argc) {
                 invalid_arg = true;
                 break;
             }
-            params.controlnet_path = argv[i];
-        } else if (arg == "--upscale-model") {
+            params.writer_queue = std::stoi(argv[i]);
+        } else if (arg == "--encode-threads") {
             if (++i >= argc) {
                 invalid_arg = true;
                 break;
             }
-            params.esrgan_path = argv[i];
-        } else if (arg == "--embd-dir") {
+            params.encode_threads = std::stoi(argv[i]);
+        } else if (arg == "--upscale-threads") {
             if (++i >= argc) {
                 invalid_arg = true;
                 break;
             }
-            params.embeddings_path = argv[i];
-        } else if (arg == "--stacked-id-embd-dir") {
+            params.upscale_threads = std::stoi(argv[i]);
+        } else if (arg == "--prep-threads") {
             if (++i >= argc) {
                 invalid_arg = true;
                 break;
             }
-            params.stacked_id_embeddings_path = argv[i];
-        } else if (arg == "--input-id-images-dir") {
+            params.prep_threads = std::stoi(argv[i]);
+        } else if (arg == "--cpuset") {
             if (++i >= argc) {
                 invalid_arg = true;
                 break;
             }
-            params.input_id_images_path = argv[i];
-        } else if (arg == "--type") {
+            cpuset = argv[i];
+        } else if (arg == "--cpu-affinity") {
             if (++i >= argc) {
                 invalid_arg = true;
                 break;
             }
-            std::string type        = argv[i];
-            bool found              = false;
-            std::string valid_types = "";
-            for (size_t i = 0; i < SD_TYPE_COUNT; i++) {
-                auto trait = ggml_get_type_traits((ggml_type)i);
-                std::string name(trait->type_name);
-                if (name == "f32" || trait->to_float && trait->type_size) {
-                    if (i)
-                        valid_types += ", ";
-                    valid_types += name;
-                    if (type == name) {
-                        if (ggml_quantize_requires_imatrix((ggml_type)i)) {
-                            printf("\033[35;1m[WARNING]\033[0m: type %s requires imatrix to work properly. A dummy imatrix will be used, expect poor quality.\n", trait->type_name);
-                        }
-                        params.wtype = (enum sd_type_t)i;
-                        found        = true;
-                        break;
-                    }
-                }
-            }
-            if (!found) {
-                fprintf(stderr, "error: invalid weight format %s, must be one of [%s]\n",
-                        type.c_str(),
-                        valid_types.c_str());
-                exit(1);
+            cpu_affinity = argv[i];
+            if (cpu_affinity != "none" && cpu_affinity != "compact" && cpu_affinity != "spread") {
+                invalid_arg = true;
+                break;
             }
-        } else if (arg == "--lora-model-dir") {
+        } else if (arg == "--tune-threads") {
+            tune = true;
+        } else if (arg == "--tune-file") {
             if (++i >= argc) {
                 invalid_arg = true;
                 break;
             }
-            params.lora_model_dir = argv[i];
+            thread_tuning_path = argv[i];
         } else if (arg == "-i" || arg == "--init-img") {
             if (++i >= argc) {
                 invalid_arg = true;
@@ -568,6 +4466,18 @@ int main(int argc, const char* argv[]) {
             int ret = perform_op(params);
             if (ret != 0)
                 return ret;
+        } else if (arg == "--output-format") {
+            if (++i >= argc) {
+                invalid_arg = true;
+                break;
+            }
+            params.output_format = argv[i];
+            try {
+                parse_image_format(params.output_format);
+            } catch (const std::exception& e) {
+                fprintf(stderr, "error: %s\n", e.what());
+                exit(1);
+            }
         } else if (arg == "-p" || arg == "--prompt") {
             if (++i >= argc) {
                 invalid_arg = true;
@@ -584,6 +4494,24 @@ int main(int argc, const char* argv[]) {
                 fprintf(stderr, "error: upscale multiplier must be at least 1\n");
                 exit(1);
             }
+        } else if (arg == "--upscale-tile") {
+            if (++i >= argc) {
+                invalid_arg = true;
+                break;
+            }
+            params.upscale_tile = std::stoi(argv[i]);
+        } else if (arg == "--upscale-workers") {
+            if (++i >= argc) {
+                invalid_arg = true;
+                break;
+            }
+            params.upscale_workers = std::stoi(argv[i]);
+        } else if (arg == "--upscale-memory") {
+            if (++i >= argc) {
+                invalid_arg = true;
+                break;
+            }
+            params.upscale_memory = std::stoi(argv[i]);
         } else if (arg == "-n" || arg == "--negative-prompt") {
             if (++i >= argc) {
                 invalid_arg = true;
@@ -658,6 +4586,8 @@ int main(int argc, const char* argv[]) {
             params.diffusion_flash_attn = true;  // can reduce MEM significantly
         } else if (arg == "--canny") {
             params.canny_preprocess = true;
+        } else if (arg == "--numa-workers") {
+            params.numa_workers = true;
         } else if (arg == "-b" || arg == "--batch-count") {
             if (++i >= argc) {
                 invalid_arg = true;
@@ -723,7 +4653,6 @@ int main(int argc, const char* argv[]) {
             exit(0);
         } else if (arg == "-v" || arg == "--verbose") {
             params.verbose = true;
-            printf("%s", sd_get_system_info());
         } else if (arg == "--color") {
             params.color = true;
         } else if (arg == "--slg-scale") {
@@ -783,6 +4712,69 @@ int main(int argc, const char* argv[]) {
             params.skip_layer_end = std::stof(argv[i]);
         } else if (arg == "-I" || arg == "--interactive") {
             interactive = true;
+        } else if (arg == "--jobs") {
+            if (++i >= argc) {
+                invalid_arg = true;
+                break;
+            }
+            jobs_path = argv[i];
+        } else if (arg == "--listen") {
+            if (++i >= argc) {
+                invalid_arg = true;
+                break;
+            }
+            listen_path = argv[i];
+        } else if (arg == "--preview") {
+            if (++i >= argc) {
+                invalid_arg = true;
+                break;
+            }
+            if (!preview_sink.configure(argv[i])) {
+                invalid_arg = true;
+                break;
+            }
+        } else if (arg == "--events") {
+            if (++i >= argc) {
+                invalid_arg = true;
+                break;
+            }
+            event_log.open(argv[i]);
+        } else if (arg == "--job-reorder") {
+            if (++i >= argc) {
+                invalid_arg = true;
+                break;
+            }
+            params.job_reorder = std::stoi(argv[i]);
+        } else if (arg == "--bench") {
+            if (++i >= argc) {
+                invalid_arg = true;
+                break;
+            }
+            bench_runs = std::stoi(argv[i]);
+        } else if (arg == "--bench-warmup") {
+            if (++i >= argc) {
+                invalid_arg = true;
+                break;
+            }
+            bench_warmup = std::stoi(argv[i]);
+        } else if (arg == "--bench-matrix") {
+            if (++i >= argc) {
+                invalid_arg = true;
+                break;
+            }
+            bench_matrix = argv[i];
+        } else if (arg == "--bench-results") {
+            if (++i >= argc) {
+                invalid_arg = true;
+                break;
+            }
+            bench_results_path = argv[i];
+        } else if (arg == "--job-results") {
+            if (++i >= argc) {
+                invalid_arg = true;
+                break;
+            }
+            job_results_path = argv[i];
         } else {
             fprintf(stderr, "error: unknown argument: %s\n", arg.c_str());
             print_usage(argc, argv);
@@ -794,15 +4786,104 @@ int main(int argc, const char* argv[]) {
         print_usage(argc, argv);
         exit(1);
     }
+    set_progress_callback(NULL, NULL);
+
+    /* Job or benchmark results on standard output have it to themselves:
+     * anything else printed there, by us or the library, goes to stderr */
+    FILE* results_out = NULL;
+    if ((jobs_path != "" && job_results_path == "-") || (bench_runs > 0 && bench_results_path == "-")) {
+        fflush(stdout);
+        int fd      = dup(STDOUT_FILENO);
+        results_out = fd >= 0 ? fdopen(fd, "w") : NULL;
+        if (!results_out || dup2(STDERR_FILENO, STDOUT_FILENO) < 0) {
+            fprintf(stderr, "error: failed to redirect standard output: %s\n", strerror(errno));
+            return 1;
+        }
+    }
+    if (params.verbose)
+        printf("%s", sd_get_system_info());
+
+    if (cpuset != "" && !apply_cpuset(cpuset)) {
+        fprintf(stderr, "error: failed to restrict to CPUs %s: %s\n", cpuset.c_str(), strerror(errno));
+        return 1;
+    }
+    if (cpu_affinity != "none" && params.numa_workers)
+        fprintf(stderr, "warning: --cpu-affinity is ignored with --numa-workers, which binds each worker to its node\n");
+    else
+        apply_cpu_affinity(cpu_affinity);
+
+    if (params.mode == CONVERT && jobs_path == "" && listen_path == "" && !interactive)
+        return perform_op(params);
+
+    if (tune) {
+        int ret = tune_threads(params);
+        if (ret != 0)
+            return ret;
+    }
+
+    if (bench_runs > 0) {
+        params.seed = seed;
+        FILE* results = NULL;
+        if (bench_results_path == "-") {
+            results = results_out;
+        } else if (bench_results_path != "") {
+            results = fopen(bench_results_path.c_str(), "w");
+            if (!results) {
+                fprintf(stderr, "error: failed to open %s\n", bench_results_path.c_str());
+                return 1;
+            }
+        }
+        int ret = run_bench(params, bench_runs, bench_warmup, bench_matrix, results);
+        if (results && results != results_out)
+            fclose(results);
+        if (ret != 0)
+            return ret;
+    }
+
+    if (jobs_path != "") {
+        params.seed   = seed;
+        FILE* results = results_out ? results_out : fopen(job_results_path.c_str(), "a");
+        if (!results) {
+            fprintf(stderr, "error: failed to open %s\n", job_results_path.c_str());
+            return 1;
+        }
+        int ret = run_jobs(params, jobs_path, results);
+        if (results != results_out)
+            fclose(results);
+        if (ret != 0)
+            return ret;
+    }
+
+    if (results_out) {
+        fflush(stdout);
+        dup2(fileno(results_out), STDOUT_FILENO);
+        fclose(results_out);
+    }
+
+    if (listen_path != "") {
+        params.seed = seed;
+        int ret     = serve(params, listen_path);
+        if (ret != 0)
+            return ret;
+    }
 
     if (interactive) {
         std::string display = "setsid -f feh -.";
+
+        // Prompts run in the background, so more can be queued meanwhile
+        JobScheduler scheduler;
+        scheduler.max_skip = params.job_reorder;
+        std::thread worker([&scheduler, params] {
+            run_workers(scheduler, params);
+        });
+
         while (true) {
             try {
                 std::string line;
 
                 std::cout << "> " << std::flush;
-                std::getline(std::cin, line);
+                if (!std::getline(std::cin, line))
+                    break;
 
                 if (line[0] == '!') {
                     // A command
@@ -815,12 +4896,103 @@ int main(int argc, const char* argv[]) {
                     if (cmd == "s" || cmd == "seed") {
                         seed = std::stoll(arg);
 
+                    } else if (cmd == "model") {
+                        if (arg == "") {
+                            // The worker owns the pool while it's busy
+                            scheduler.wait_idle();
+                            print_sd_ctx_pool();
+                        } else {
+                            params.model_path = arg;
+                            params.diffusion_model_path = "";
+                        }
+
+                    } else if (cmd == "diffusion-model") {
+                        params.diffusion_model_path = arg;
+                        params.model_path = "";
+
+                    } else if (cmd == "vae") {
+                        params.vae_path = arg;
+
+                    } else if (cmd == "clip_l") {
+                        params.clip_l_path = arg;
+
+                    } else if (cmd == "clip_g") {
+                        params.clip_g_path = arg;
+
+                    } else if (cmd == "t5xxl") {
+                        params.t5xxl_path = arg;
+
+                    } else if (cmd == "upscale-model") {
+                        params.esrgan_path = arg;
+                        if (arg == "") {
+                            scheduler.wait_idle();
+                            unload_upscaler_ctx();
+                        }
+
+                    } else if (cmd == "upscale-repeats") {
+                        params.upscale_repeats = std::stoi(arg);
+
+                    } else if (cmd == "upscale-tile") {
+                        params.upscale_tile = std::stoi(arg);
+
+                    } else if (cmd == "upscale-workers") {
+                        params.upscale_workers = std::stoi(arg);
+
+                    } else if (cmd == "upscale-memory") {
+                        params.upscale_memory = std::stoi(arg);
+
+                    } else if (cmd == "upscale-threads") {
+                        params.upscale_threads = std::stoi(arg);
+
+                    } else if (cmd == "prep-threads") {
+                        params.prep_threads = std::stoi(arg);
+
+                    } else if (cmd == "encode-threads") {
+                        params.encode_threads = std::stoi(arg);
+
+                    } else if (cmd == "unload") {
+                        scheduler.wait_idle();
+                        if (arg == "" || arg == "models")
+                            unload_sd_ctx_pool();
+                        if (arg == "" || arg == "upscaler")
+                            unload_upscaler_ctx();
+
+                    } else if (cmd == "model-cache-size") {
+                        params.model_cache_size = std::stoi(arg);
+
+                    } else if (cmd == "convert-cache") {
+                        params.convert_cache = arg;
+
+                    } else if (cmd == "image-cache-size") {
+                        params.image_cache_size = std::stoi(arg);
+
+                    } else if (cmd == "format") {
+                        parse_image_format(arg);
+                        params.output_format = arg;
+
                     } else if (cmd == "display") {
                         display = arg;
 
+                    } else if (cmd == "preview") {
+                        preview_sink.configure(arg);
+
                     } else if (cmd == "q" || cmd == "quit") {
                         break;
 
+                    } else if (cmd == "buffers") {
+                        buffer_pool.print_stats();
+
+                    } else if (cmd == "queue") {
+                        scheduler.print_queue();
+
+                    } else if (cmd == "cancel") {
+                        if (!scheduler.cancel(std::stoull(arg)))
+                            std::cerr << "No queued job " << arg << std::endl;
+
+                    } else if (cmd == "wait") {
+                        scheduler.wait_idle();
+                        image_writer.wait();
+
                     } else if (cmd == "ratio") {
                         std::istringstream ss{arg};
                         double w, h;
@@ -863,6 +5035,53 @@ int main(int argc, const char* argv[]) {
                     } else if (cmd == "batch") {
                         params.batch_count = std::stoi(arg);
 
+                    } else if (cmd == "t" || cmd == "threads") {
+                        params.n_threads = std::stoi(arg);
+
+                    } else if (cmd == "sampling-method") {
+                        int found = find_str(sample_method_str, N_SAMPLE_METHODS, arg);
+                        if (found < 0)
+                            throw std::invalid_argument("invalid sampling method " + arg);
+                        params.sample_method = (sample_method_t)found;
+
+                    } else if (cmd == "resize-filter") {
+                        int found = find_str(resize_filter_str, N_RESIZE_FILTERS, arg);
+                        if (found < 0)
+                            throw std::invalid_argument("invalid resize filter " + arg);
+                        params.resize_filter = (ResizeFilter)found;
+
+                    } else if (cmd == "resize-fit") {
+                        int found = find_str(resize_fit_str, N_RESIZE_FITS, arg);
+                        if (found < 0)
+                            throw std::invalid_argument("invalid resize fit " + arg);
+                        params.resize_fit = (ResizeFit)found;
+
+                    } else if (cmd == "schedule") {
+                        int found = find_str(schedule_str, N_SCHEDULES, arg);
+                        if (found < 0)
+                            throw std::invalid_argument("invalid schedule " + arg);
+                        params.schedule = (schedule_t)found;
+
+                    } else if (cmd == "rng") {
+                        if (arg == "std_default")
+                            params.rng_type = STD_DEFAULT_RNG;
+                        else if (arg == "cuda")
+                            params.rng_type = CUDA_RNG;
+                        else
+                            throw std::invalid_argument("invalid rng " + arg);
+
+                    } else if (cmd == "vae-tiling") {
+                        params.vae_tiling = arg != "off";
+
+                    } else if (cmd == "clip-on-cpu") {
+                        params.clip_on_cpu = arg != "off";
+
+                    } else if (cmd == "vae-on-cpu") {
+                        params.vae_on_cpu = arg != "off";
+
+                    } else if (cmd == "diffusion-fa") {
+                        params.diffusion_flash_attn = arg != "off";
+
                     } else {
                         std::cerr << "Unrecognized command " << cmd << std::endl;
 
@@ -875,42 +5094,23 @@ int main(int argc, const char* argv[]) {
                         params.seed = rand();
                     else
                         params.seed = seed;
+                    parse_image_format(params.output_format);
 
-                    std::string outFile, outPrefix;
-                    unsigned int i;
-                    struct stat sbuf;
-                    {
-                        std::stringstream outPrefixStr;
-                        outPrefixStr << "output/"
-                            << params.seed << "-";
-                        for (i = 0; i < line.size() && i < 32; i++) {
-                            char c = line[i];
-                            if ((c >= 'A' && c <= 'Z') ||
-                                (c >= 'a' && c <= 'z') ||
-                                (c >= '0' && c <= '9')) {
-                                outPrefixStr << c;
-                            } else if (c == ' ') {
-                                outPrefixStr << '_';
-                            }
+                    // The job runs with a snapshot of the current settings
+                    Job job;
+                    job.params      = params;
+                    job.ctx_params  = sd_ctx_params(params);
+                    job.auto_output = true;
+                    job.emit        = [display](const nlohmann::json& result) {
+                        if (result["status"] != "ok") {
+                            std::cerr << "job " << result["id"] << " failed: " << result["error"].get<std::string>() << std::endl;
+                        } else if (display != "" && !preview_sink.active() && result["outputs"].size() > 0) {
+                            std::string cmd = display + " " + result["outputs"][0].get<std::string>();
+                            system(cmd.c_str());
                         }
-                        outPrefixStr << '-';
-                        outPrefix = outPrefixStr.str();
-                    }
-                    for (i = 0;; i++) {
-                        outFile = outPrefix + std::to_string(i) + ".png";
-                        if (stat(outFile.c_str(), &sbuf))
-                            break;
-                    }
-                    params.output_path = outFile;
-
-                    int ret = perform_op(params);
-                    if (ret != 0)
-                        return ret;
-
-                    if (display != "") {
-                        std::string cmd = display + " " + outFile;
-                        system(cmd.c_str());
-                    }
+                    };
+                    uint64_t n = scheduler.push(std::move(job));
+                    std::cout << "queued job " << n << std::endl;
 
                 }
 
@@ -919,95 +5119,318 @@ int main(int argc, const char* argv[]) {
 
             }
         }
+
+        // Finish whatever is queued
+        scheduler.close();
+        worker.join();
     }
 
+    image_writer.finish();
     return 0;
 }
+#endif
 
-int perform_op(SDParams &params) {
-    bool vae_decode_only          = true;
-    uint8_t* input_image_buffer   = NULL;
-    uint8_t* control_image_buffer = NULL;
-    uint8_t* mask_image_buffer    = NULL;
+/* Upscaling is done in overlapping tiles, each run through every repeat
+ * before being placed, so memory is bounded by the tile size rather than the
+ * (up to 16x) intermediate image. Tiles from every image in the batch share
+ * one queue, drained by one worker per upscaler context. Tiles are blended
+ * into their image in order, each as a running weighted average with weights
+ * tapering to the tile's edges, which hides the seams. */
+struct UpscaleTile {
+    int image;
+    int index;  // within its image, in raster order
+    int x, y, w, h;
+};
 
-    if (params.mode == IMG2IMG || params.mode == IMG2VID) {
-        vae_decode_only = false;
+struct UpscaleImage {
+    sd_image_t source;
+    sd_image_t result = {0, 0, 0, NULL};
+    int scale         = 0;
+    int cols = 0, rows = 0;
+    std::vector<int> xs, ys;  // tile origins
+    int tile_w = 0, tile_h = 0;
+    int next_blend = 0;
+    std::map<int, sd_image_t> done;  // upscaled tiles waiting for their turn
+    bool failed = false;
+};
 
-        int c              = 0;
-        int width          = 0;
-        int height         = 0;
-        input_image_buffer = stbi_load(params.input_path.c_str(), &width, &height, &c, 3);
-        if (input_image_buffer == NULL) {
-            fprintf(stderr, "load image from '%s' failed\n", params.input_path.c_str());
-            return 1;
+// Evenly spaced tile origins covering length with tiles of size tile
+static std::vector<int> upscale_tile_origins(int length, int tile, int overlap) {
+    std::vector<int> origins;
+    if (tile >= length) {
+        origins.push_back(0);
+        return origins;
+    }
+    int count = (length - overlap + (tile - overlap) - 1) / (tile - overlap);
+    count     = std::max(count, 2);
+    for (int i = 0; i < count; i++)
+        origins.push_back((int)((int64_t)i * (length - tile) / (count - 1)));
+    return origins;
+}
+
+// Blending weight of a tile at this offset within it, tapering only at edges that overlap another tile
+static float upscale_tile_weight(int pos, int size, int ramp, bool taper_start, bool taper_end) {
+    float weight = 1.0f;
+    if (taper_start)
+        weight = std::min(weight, (pos + 0.5f) / ramp);
+    if (taper_end)
+        weight = std::min(weight, (size - pos - 0.5f) / ramp);
+    return std::max(weight, 0.0f);
+}
+
+/* Blend tile index into its image. Weights are separable, so the total weight
+ * of the tiles blended so far at each pixel is the sum over earlier rows of
+ * tiles, times the sum over every column, plus this row's weight times the
+ * sum over columns up to this one. */
+static void blend_upscale_tile(UpscaleImage& image, int index, const sd_image_t& tile) {
+    int s    = image.scale;
+    int col  = index % image.cols;
+    int row  = index / image.cols;
+    int x0   = image.xs[col] * s;
+    int y0   = image.ys[row] * s;
+    int tw   = image.tile_w * s;
+    int th   = image.tile_h * s;
+    int ramp = std::max(1, s * 8);
+    int ch   = tile.channel;
+
+    // Weight of tile column c at image column px, or of tile row r at image row py
+    auto weight_x = [&](int c, int px) {
+        int t = px - image.xs[c] * s;
+        return t < 0 || t >= tw ? 0.0f : upscale_tile_weight(t, tw, ramp, c > 0, c < image.cols - 1);
+    };
+    auto weight_y = [&](int r, int py) {
+        int t = py - image.ys[r] * s;
+        return t < 0 || t >= th ? 0.0f : upscale_tile_weight(t, th, ramp, r > 0, r < image.rows - 1);
+    };
+
+    std::vector<float> wx(tile.width), all_x(tile.width), upto_x(tile.width);
+    for (int tx = 0; tx < (int)tile.width; tx++) {
+        int px = x0 + tx;
+        wx[tx] = weight_x(col, px);
+        for (int c = 0; c < image.cols; c++) {
+            float w = weight_x(c, px);
+            all_x[tx] += w;
+            if (c <= col)
+                upto_x[tx] += w;
         }
-        if (c < 3) {
-            fprintf(stderr, "the number of channels for the input image must be >= 3, but got %d channels\n", c);
-            free(input_image_buffer);
-            return 1;
+    }
+
+    for (int ty = 0; ty < (int)tile.height; ty++) {
+        int py        = y0 + ty;
+        float wy      = weight_y(row, py);
+        float above_y = 0.0f;
+        for (int r = 0; r < row; r++)
+            above_y += weight_y(r, py);
+        uint8_t* out      = image.result.data + ((size_t)py * image.result.width + x0) * ch;
+        const uint8_t* in = tile.data + (size_t)ty * tile.width * ch;
+        for (int tx = 0; tx < (int)tile.width; tx++) {
+            float total = above_y * all_x[tx] + wy * upto_x[tx];
+            float alpha = total > 0.0f ? wy * wx[tx] / total : 1.0f;
+            for (int k = 0; k < ch; k++) {
+                size_t i = (size_t)tx * ch + k;
+                float v  = out[i] + alpha * (in[i] - (float)out[i]);
+                out[i]   = (uint8_t)std::min(std::max(v + 0.5f, 0.0f), 255.0f);
+            }
         }
-        if (width <= 0) {
-            fprintf(stderr, "error: the width of image must be greater than 0\n");
-            free(input_image_buffer);
-            return 1;
+    }
+}
+
+static void upscale_images(const SDParams& params, sd_image_t* images, int count) {
+    int upscale_factor = 4;  // unused for RealESRGAN_x4plus_anime_6B.pth
+    int tile           = params.upscale_tile > 0 ? params.upscale_tile : INT_MAX;
+    int overlap        = std::min(32, tile / 4);
+
+    std::vector<UpscaleImage> jobs(count);
+    std::deque<UpscaleTile> tiles;
+    size_t tile_memory = 0;
+    for (int i = 0; i < count; i++) {
+        UpscaleImage& image = jobs[i];
+        image.source        = images[i];
+        if (image.source.data == NULL)
+            continue;
+        image.tile_w = std::min(tile, (int)image.source.width);
+        image.tile_h = std::min(tile, (int)image.source.height);
+        image.xs     = upscale_tile_origins(image.source.width, image.tile_w, overlap);
+        image.ys     = upscale_tile_origins(image.source.height, image.tile_h, overlap);
+        image.cols   = image.xs.size();
+        image.rows   = image.ys.size();
+        for (int r = 0; r < image.rows; r++) {
+            for (int c = 0; c < image.cols; c++)
+                tiles.push_back(UpscaleTile{i, r * image.cols + c, image.xs[c], image.ys[r], image.tile_w, image.tile_h});
         }
-        if (height <= 0) {
-            fprintf(stderr, "error: the height of image must be greater than 0\n");
-            free(input_image_buffer);
-            return 1;
+        // The library holds each stage's input and output as float tensors
+        size_t w = image.tile_w, h = image.tile_h, stage = 0;
+        for (int u = 0; u < params.upscale_repeats; u++) {
+            stage = std::max(stage, (w * h + w * h * upscale_factor * upscale_factor) * 3 * sizeof(float));
+            w *= upscale_factor;
+            h *= upscale_factor;
         }
+        tile_memory = std::max(tile_memory, stage + w * h * 3);
+    }
+    if (tiles.size() == 0)
+        return;
 
-        // Resize input image ...
-        if (params.height != height || params.width != width) {
-            printf("resize input image from %dx%d to %dx%d\n", width, height, params.width, params.height);
-            int resized_height = params.height;
-            int resized_width  = params.width;
+    int workers = std::max(1, params.upscale_workers);
+    if (params.upscale_memory > 0 && tile_memory > 0)
+        workers = std::min(workers, std::max(1, (int)((size_t)params.upscale_memory * 1024 * 1024 / tile_memory)));
+    workers = std::min(workers, (int)tiles.size());
+    const std::vector<upscaler_ctx_t*>& ctxs = acquire_upscaler_ctxs(params, workers);
+    if (ctxs.size() == 0) {
+        printf("new_upscaler_ctx failed\n");
+        return;
+    }
 
-            uint8_t* resized_image_buffer = (uint8_t*)malloc(resized_height * resized_width * 3);
-            if (resized_image_buffer == NULL) {
-                fprintf(stderr, "error: allocate memory for resize input image\n");
-                free(input_image_buffer);
-                return 1;
+    std::mutex lock;
+    auto work = [&](upscaler_ctx_t* ctx) {
+        std::unique_lock<std::mutex> guard(lock);
+        while (tiles.size() > 0) {
+            UpscaleTile t = tiles.front();
+            tiles.pop_front();
+            UpscaleImage& image = jobs[t.image];
+            if (image.failed)
+                continue;
+            guard.unlock();
+
+            // Copy out the tile and run it through every repeat
+            int ch          = image.source.channel;
+            sd_image_t part = {(uint32_t)t.w, (uint32_t)t.h, (uint32_t)ch, (uint8_t*)malloc((size_t)t.w * t.h * ch)};
+            for (int y = 0; y < t.h; y++)
+                memcpy(part.data + (size_t)y * t.w * ch,
+                       image.source.data + ((size_t)(t.y + y) * image.source.width + t.x) * ch,
+                       (size_t)t.w * ch);
+            for (int u = 0; u < params.upscale_repeats && part.data; u++) {
+                sd_image_t upscaled = upscale(ctx, part, upscale_factor);
+                free(part.data);
+                part = upscaled;
+            }
+
+            guard.lock();
+            int scale = part.data ? (int)(part.width / t.w) : 0;
+            if (part.data == NULL || (image.scale && scale != image.scale) ||
+                part.width != (uint32_t)(t.w * scale) || part.height != (uint32_t)(t.h * scale)) {
+                printf("upscale failed\n");
+                free(part.data);
+                image.failed = true;
+                continue;
+            }
+            if (!image.result.data) {
+                image.scale  = scale;
+                image.result = {image.source.width * scale, image.source.height * scale, (uint32_t)ch,
+                                (uint8_t*)calloc((size_t)image.source.width * scale * image.source.height * scale, ch)};
             }
-            stbir_resize(input_image_buffer, width, height, 0,
-                         resized_image_buffer, resized_width, resized_height, 0, STBIR_TYPE_UINT8,
-                         3 /*RGB channel*/, STBIR_ALPHA_CHANNEL_NONE, 0,
-                         STBIR_EDGE_CLAMP, STBIR_EDGE_CLAMP,
-                         STBIR_FILTER_BOX, STBIR_FILTER_BOX,
-                         STBIR_COLORSPACE_SRGB, nullptr);
-
-            // Save resized result
-            free(input_image_buffer);
-            input_image_buffer = resized_image_buffer;
-        }
-    }
-
-    static sd_ctx_t* sd_ctx = nullptr;
-    if (!sd_ctx) {
-        sd_ctx = new_sd_ctx(params.model_path.c_str(),
-                                  params.clip_l_path.c_str(),
-                                  params.clip_g_path.c_str(),
-                                  params.t5xxl_path.c_str(),
-                                  params.diffusion_model_path.c_str(),
-                                  params.vae_path.c_str(),
-                                  params.taesd_path.c_str(),
-                                  params.controlnet_path.c_str(),
-                                  params.lora_model_dir.c_str(),
-                                  params.embeddings_path.c_str(),
-                                  params.stacked_id_embeddings_path.c_str(),
-                                  vae_decode_only,
-                                  params.vae_tiling,
-                                  false,
-                                  params.n_threads,
-                                  params.wtype,
-                                  params.rng_type,
-                                  params.schedule,
-                                  params.clip_on_cpu,
-                                  params.control_net_cpu,
-                                  params.vae_on_cpu,
-                                  params.diffusion_flash_attn);
+            image.done[t.index] = part;
+
+            // Blend whatever tiles are now next in order
+            while (image.done.count(image.next_blend)) {
+                sd_image_t ready = image.done[image.next_blend];
+                image.done.erase(image.next_blend);
+                blend_upscale_tile(image, image.next_blend, ready);
+                free(ready.data);
+                image.next_blend++;
+            }
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < ctxs.size(); i++)
+        threads.emplace_back(work, ctxs[i]);
+    work(ctxs[0]);
+    for (auto& thread : threads)
+        thread.join();
+
+    // Replace each image with its upscaled version, or leave it if that failed
+    for (int i = 0; i < count; i++) {
+        UpscaleImage& image = jobs[i];
+        for (auto& part : image.done)
+            free(part.second.data);
+        if (image.failed || !image.result.data) {
+            free(image.result.data);
+            continue;
+        }
+        free(images[i].data);
+        images[i] = image.result;
+    }
+}
+
+/* Convert the model (with its VAE, if it's a full checkpoint) to a GGUF file
+ * of --type. The output is -o if that's a .gguf, otherwise a file named
+ * after the model in -o's directory. */
+static int convert_model(const SDParams& params, std::function<void(const std::string&, bool)> on_saved, OpReport* report) {
+    std::string source = params.model_path.size() ? params.model_path : params.diffusion_model_path;
+    if (source == "") {
+        fprintf(stderr, "error: convert needs a model\n");
+        return 1;
+    }
+    std::string output = params.output_path;
+    if (output.size() < 5 || output.compare(output.size() - 5, 5, ".gguf") != 0) {
+        size_t slash = output.find_last_of('/');
+        output       = (slash != std::string::npos ? output.substr(0, slash + 1) : "") + model_stem(source);
+        output += std::string(".") + (params.wtype < SD_TYPE_COUNT ? sd_type_name(params.wtype) : "converted") + ".gguf";
+    }
+
+    // convert() truncates its output before reading its input
+    struct stat source_st, output_st;
+    if (stat(source.c_str(), &source_st) == 0 && stat(output.c_str(), &output_st) == 0 &&
+        source_st.st_dev == output_st.st_dev && source_st.st_ino == output_st.st_ino) {
+        fprintf(stderr, "error: converting %s would overwrite it\n", source.c_str());
+        return 1;
+    }
+
+    printf("converting %s to %s\n", source.c_str(), output.c_str());
+    auto start = std::chrono::steady_clock::now();
+    bool ok    = convert(source.c_str(), params.model_path.size() ? params.vae_path.c_str() : "", output.c_str(), params.wtype);
+    if (report)
+        report->generate_time = seconds_since(start);
+    event_log.emit("convert", {{"source", source}, {"output", output}, {"ok", ok}, {"seconds", seconds_since(start)}});
+    if (!ok) {
+        fprintf(stderr, "converting %s failed\n", source.c_str());
+        return 1;
+    }
+    if (report)
+        report->outputs.push_back(output);
+    if (on_saved)
+        on_saved(output, true);
+    return 0;
+}
+
+int perform_op(SDParams &params, std::function<void(const std::string&, bool)> on_saved, OpReport* report) {
+    if (params.mode == CONVERT)
+        return convert_model(params, on_saved, report);
+
+    bool vae_decode_only        = true;
+    uint8_t* input_image_buffer = NULL;
+    uint8_t* mask_image_buffer  = NULL;
+
+    image_cache.set_max_size((size_t)params.image_cache_size * 1024 * 1024);
+    std::shared_ptr<const DecodedImage> input_image_data, control_image_data, mask_image_data;
+
+    if (params.mode == IMG2IMG || params.mode == IMG2VID) {
+        vae_decode_only = false;
+
+        // Loaded already resized, if it's been used at this size before
+        input_image_data = image_cache.load(params.input_path, 3, params.width, params.height,
+                                            params.resize_filter, params.resize_fit,
+                                            stage_threads(params, params.prep_threads));
+        if (!input_image_data) {
+            fprintf(stderr, "load image from '%s' failed\n", params.input_path.c_str());
+            return 1;
+        }
+        if (input_image_data->src_channels < 3) {
+            fprintf(stderr, "the number of channels for the input image must be >= 3, but got %d channels\n", input_image_data->src_channels);
+            return 1;
+        }
+        input_image_buffer = const_cast<uint8_t*>(input_image_data->data.data());
     }
 
+    ImageFormat format = parse_image_format(params.output_format);
+    const char* ext    = image_format_ext(format);
+    format.threads     = params.encode_threads;
+    image_writer.configure(params.writer_threads, params.writer_queue);
+
+    auto start       = std::chrono::steady_clock::now();
+    sd_ctx_t* sd_ctx = acquire_sd_ctx(params, vae_decode_only);
+    if (report)
+        report->load_time = seconds_since(start);
     if (sd_ctx == NULL) {
         printf("new_sd_ctx_t failed\n");
         return 1;
@@ -1015,41 +5438,43 @@ int perform_op(SDParams &params) {
 
     sd_image_t* control_image = NULL;
     if (params.controlnet_path.size() > 0 && params.control_image_path.size() > 0) {
-        int c                = 0;
-        control_image_buffer = stbi_load(params.control_image_path.c_str(), &params.width, &params.height, &c, 3);
-        if (control_image_buffer == NULL) {
+        int n_threads = stage_threads(params, params.prep_threads);
+        if (params.canny_preprocess)  // apply preprocessor
+            control_image_data = image_cache.preprocess(params.control_image_path, control_preprocessors[0], n_threads);
+        else
+            control_image_data = image_cache.load(params.control_image_path, 3);
+        if (!control_image_data) {
             fprintf(stderr, "load image from '%s' failed\n", params.control_image_path.c_str());
             return 1;
         }
+        params.width  = control_image_data->width;
+        params.height = control_image_data->height;
         control_image = new sd_image_t{(uint32_t)params.width,
                                        (uint32_t)params.height,
                                        3,
-                                       control_image_buffer};
-        if (params.canny_preprocess) {  // apply preprocessor
-            control_image->data = preprocess_canny(control_image->data,
-                                                   control_image->width,
-                                                   control_image->height,
-                                                   0.08f,
-                                                   0.08f,
-                                                   0.8f,
-                                                   1.0f,
-                                                   false);
-        }
+                                       const_cast<uint8_t*>(control_image_data->data.data())};
     }
 
     if (params.mask_path != "") {
-        int c             = 0;
-        mask_image_buffer = stbi_load(params.mask_path.c_str(), &params.width, &params.height, &c, 1);
+        mask_image_data = image_cache.load(params.mask_path, 1);
+        if (!mask_image_data) {
+            fprintf(stderr, "load image from '%s' failed\n", params.mask_path.c_str());
+            delete control_image;
+            return 1;
+        }
+        params.width  = mask_image_data->width;
+        params.height = mask_image_data->height;
     } else {
-        std::vector<uint8_t> arr(params.width * params.height, 255);
-        mask_image_buffer = arr.data();
+        mask_image_data = opaque_mask(params.width, params.height);
     }
+    mask_image_buffer = const_cast<uint8_t*>(mask_image_data->data.data());
     sd_image_t mask_image = {(uint32_t)params.width,
                              (uint32_t)params.height,
                              1,
                              mask_image_buffer};
 
     sd_image_t* results;
+    start = std::chrono::steady_clock::now();
     if (params.mode == TXT2IMG) {
         results = txt2img(sd_ctx,
                           params.prompt.c_str(),
@@ -1096,21 +5521,27 @@ int perform_op(SDParams &params) {
                               params.seed);
             if (results == NULL) {
                 printf("generate failed\n");
-                free_sd_ctx(sd_ctx);
-                sd_ctx = nullptr;
+                release_sd_ctx(sd_ctx);
                 return 1;
             }
+            if (report)
+                report->generate_time = seconds_since(start);
+            for (int i = 0; i < params.video_frames; i++)
+                preview_sink.push(results[i]);
             size_t last            = params.output_path.find_last_of(".");
             std::string dummy_name = last != std::string::npos ? params.output_path.substr(0, last) : params.output_path;
             for (int i = 0; i < params.video_frames; i++) {
                 if (results[i].data == NULL) {
                     continue;
                 }
-                std::string final_image_path = i > 0 ? dummy_name + "_" + std::to_string(i + 1) + ".png" : dummy_name + ".png";
-                stbi_write_png(final_image_path.c_str(), results[i].width, results[i].height, results[i].channel,
-                               results[i].data, 0, get_image_params(params, params.seed + i).c_str());
-                printf("save result image to '%s'\n", final_image_path.c_str());
-                free(results[i].data);
+                std::string final_image_path = i > 0 ? dummy_name + "_" + std::to_string(i + 1) + ext : dummy_name + ext;
+                if (report)
+                    report->outputs.push_back(final_image_path);
+                image_writer.push(ImageWriteJob{final_image_path,
+                                                results[i],
+                                                get_image_params(params, params.seed + i),
+                                                format,
+                                                on_saved});
                 results[i].data = NULL;
             }
             free(results);
@@ -1146,36 +5577,21 @@ int perform_op(SDParams &params) {
 
     if (results == NULL) {
         printf("generate failed\n");
-        free_sd_ctx(sd_ctx);
-        sd_ctx = nullptr;
+        release_sd_ctx(sd_ctx);
         return 1;
     }
+    if (report)
+        report->generate_time = seconds_since(start);
+    for (int i = 0; i < params.batch_count; i++)
+        preview_sink.push(results[i]);
 
-    int upscale_factor = 4;  // unused for RealESRGAN_x4plus_anime_6B.pth
+    start = std::chrono::steady_clock::now();
     if (params.esrgan_path.size() > 0 && params.upscale_repeats > 0) {
-        upscaler_ctx_t* upscaler_ctx = new_upscaler_ctx(params.esrgan_path.c_str(),
-                                                        params.n_threads);
-
-        if (upscaler_ctx == NULL) {
-            printf("new_upscaler_ctx failed\n");
-        } else {
-            for (int i = 0; i < params.batch_count; i++) {
-                if (results[i].data == NULL) {
-                    continue;
-                }
-                sd_image_t current_image = results[i];
-                for (int u = 0; u < params.upscale_repeats; ++u) {
-                    sd_image_t upscaled_image = upscale(upscaler_ctx, current_image, upscale_factor);
-                    if (upscaled_image.data == NULL) {
-                        printf("upscale failed\n");
-                        break;
-                    }
-                    free(current_image.data);
-                    current_image = upscaled_image;
-                }
-                results[i] = current_image;  // Set the final upscaled image as the result
-            }
-        }
+        upscale_images(params, results, params.batch_count);
+        event_log.emit("upscale", {{"images", params.batch_count}, {"repeats", params.upscale_repeats},
+                                   {"seconds", seconds_since(start)}});
+        if (report)
+            report->upscale_time = seconds_since(start);
     }
 
     size_t last            = params.output_path.find_last_of(".");
@@ -1184,16 +5600,18 @@ int perform_op(SDParams &params) {
         if (results[i].data == NULL) {
             continue;
         }
-        std::string final_image_path = i > 0 ? dummy_name + "_" + std::to_string(i + 1) + ".png" : dummy_name + ".png";
-        stbi_write_png(final_image_path.c_str(), results[i].width, results[i].height, results[i].channel,
-                       results[i].data, 0, get_image_params(params, params.seed + i).c_str());
-        printf("save result image to '%s'\n", final_image_path.c_str());
-        free(results[i].data);
+        std::string final_image_path = i > 0 ? dummy_name + "_" + std::to_string(i + 1) + ext : dummy_name + ext;
+        if (report)
+            report->outputs.push_back(final_image_path);
+        image_writer.push(ImageWriteJob{final_image_path,
+                                        results[i],
+                                        get_image_params(params, params.seed + i),
+                                        format,
+                                        on_saved});
         results[i].data = NULL;
     }
     free(results);
-    free(control_image_buffer);
-    free(input_image_buffer);
+    delete control_image;
 
     return 0;
 }